@@ -10,8 +10,16 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/errno.h>
+#define circ_calloc(n, size) kcalloc(n, size, GFP_KERNEL)
+#define circ_free(ptr) kfree(ptr)
 #else
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#define circ_calloc(n, size) calloc(n, size)
+#define circ_free(ptr) free(ptr)
 #endif
 
 #include "aesd-circular-buffer.h"
@@ -29,56 +37,148 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    uint8_t cur; //current entry index;
-    size_t pos=0;
+    uint32_t lo = 0, hi, mid;
     aesd_buffer_entry_t *entry;
-    for (cur=0; cur<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; cur++){
-		/* Guard for not full buffer*/
-		if (!(buffer->full) && ((buffer->out_offs + cur) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) == buffer->in_offs)
-			break;
-		entry = AESD_CIRCULAR_BUFFER_GET_ENTRY(buffer, cur);
-		if (entry != NULL){
-			if (pos + entry->size > char_offset){
-				if (entry_offset_byte_rtn) //check address is valid
-					*entry_offset_byte_rtn = char_offset - pos;
-				return entry;
-			}
-			else
-				pos += entry->size;
-		}
+
+    if (!buffer->count || char_offset >= aesd_circular_buffer_size(buffer))
+        return NULL;
+
+    // the last entry starting at or before char_offset, it is never empty
+    hi = buffer->count - 1;
+    while (lo < hi){
+        mid = lo + (hi - lo + 1) / 2;
+        if (aesd_circular_buffer_entry_offset(buffer, mid) <= char_offset)
+            lo = mid;
+        else
+            hi = mid - 1;
     }
-    /**
-    * TODO: implement per description
-    */
-    return NULL;
+    entry = AESD_CIRCULAR_BUFFER_GET_ENTRY(buffer, lo);
+    if (entry_offset_byte_rtn) //check address is valid
+        *entry_offset_byte_rtn = char_offset - aesd_circular_buffer_entry_offset(buffer, lo);
+    return entry;
+}
+
+/**
+* @return byte offset of entry @param index (zero referenced, from the oldest one) in @param buffer,
+* if all buffer strings were concatenated end to end. Index must be less than buffer->count.
+* Any necessary locking must be performed by caller.
+*/
+size_t aesd_circular_buffer_entry_offset(struct aesd_circular_buffer *buffer, uint32_t index)
+{
+	return buffer->offs[(buffer->out_offs + index) & buffer->mask] - buffer->offs[buffer->out_offs];
+}
+
+/**
+* @return total size of entries stored in @param buffer
+* Any necessary locking must be performed by caller.
+*/
+size_t aesd_circular_buffer_size(struct aesd_circular_buffer *buffer)
+{
+	if (!buffer->count)
+		return 0;
+	return buffer->end - buffer->offs[buffer->out_offs];
+}
+
+/**
+* @return stream position of the oldest entry of @param buffer, end of stream if buffer is empty.
+* Stream position of byte at offset n of concatenated entries is start + n.
+* Any necessary locking must be performed by caller.
+*/
+size_t aesd_circular_buffer_start(struct aesd_circular_buffer *buffer)
+{
+	if (!buffer->count)
+		return buffer->end;
+	return buffer->offs[buffer->out_offs];
 }
 
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
-* If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
-* new start location.
+* If the buffer was already full, drops the oldest entry and advances buffer->out_offs to the
+* new start location. Slot of dropped entry is cleared, caller must take its buffptr before.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
 */
 void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
-	uint8_t in_pos = buffer->in_offs;
+	uint32_t in_pos = buffer->in_offs;
+	// storage can be larger than capacity, slot of the oldest is not reused here
+	if (buffer->full){
+		memset(&buffer->entry[buffer->out_offs], 0, sizeof(struct aesd_buffer_entry));
+		buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
+		buffer->count--;
+	}
 	buffer->entry[in_pos] = *add_entry;
-	// TODO try to save const modifier using
-//	buffer->entry[in_pos]->buffptr = add_entry->buffptr;
-//	buffer->entry[in_pos]->size = add_entry->size;
-	buffer->in_offs = (in_pos + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-	if (buffer->full)
-		buffer->out_offs = buffer->in_offs;
-	else
-		if (buffer->in_offs == buffer->out_offs)
-			buffer->full = true;
+	buffer->offs[in_pos] = buffer->end;
+	buffer->end += add_entry->size;
+	buffer->in_offs = (in_pos + 1) & buffer->mask;
+	buffer->count++;
+	buffer->full = (buffer->count == buffer->capacity);
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Removes the oldest entry of @param buffer and stores it to @param removed (if not NULL).
+* Any necessary locking must be handled by the caller, buffptr of removed entry must be freed by caller.
+* @return false if buffer is empty
+*/
+bool aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed)
+{
+	if (!buffer->count)
+		return false;
+	if (removed)
+		*removed = buffer->entry[buffer->out_offs];
+	memset(&buffer->entry[buffer->out_offs], 0, sizeof(struct aesd_buffer_entry));
+	buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
+	buffer->count--;
+	buffer->full = false;
+	return true;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty state.
+* Storage and capacity set by aesd_circular_buffer_alloc are kept.
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
-    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+	if (buffer->entry)
+		memset(buffer->entry, 0, (buffer->mask + 1) * sizeof(struct aesd_buffer_entry));
+	buffer->end = 0;
+	buffer->count = 0;
+	buffer->in_offs = 0;
+	buffer->out_offs = 0;
+	buffer->full = false;
+}
+
+/**
+* Allocates storage of @param buffer for @param capacity entries and initializes it to an empty state.
+* Storage is rounded up to power of two so indexes are masked.
+* @return 0 on success, -EINVAL for wrong capacity, -ENOMEM
+*/
+int aesd_circular_buffer_alloc(struct aesd_circular_buffer *buffer, uint32_t capacity)
+{
+	uint32_t size = 1;
+
+	memset(buffer, 0, sizeof(struct aesd_circular_buffer));
+	if (capacity < 1 || capacity > AESDCHAR_MAX_CAPACITY)
+		return -EINVAL;
+	while (size < capacity)
+		size <<= 1;
+	buffer->entry = circ_calloc(size, sizeof(struct aesd_buffer_entry));
+	buffer->offs = circ_calloc(size, sizeof(size_t));
+	if (!buffer->entry || !buffer->offs){
+		aesd_circular_buffer_free(buffer);
+		return -ENOMEM;
+	}
+	buffer->mask = size - 1;
+	buffer->capacity = capacity;
+	return 0;
+}
+
+/**
+* Frees storage of @param buffer. Memory referenced by entries must be freed by caller before.
+*/
+void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer)
+{
+	circ_free(buffer->entry);
+	circ_free(buffer->offs);
+	memset(buffer, 0, sizeof(struct aesd_circular_buffer));
 }
@@ -17,7 +17,14 @@
 #endif
 
 
+/**
+ * Default number of commands kept by the buffer (capacity module parameter)
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Upper limit of capacity
+ */
+#define AESDCHAR_MAX_CAPACITY 65536
 
 
 typedef struct aesd_buffer_entry
@@ -35,18 +42,41 @@ typedef struct aesd_buffer_entry
 typedef struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations.
+     * Array has power of two size (mask + 1) >= capacity, indexes are masked.
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Prefix sums of entry sizes: stream position of the first byte of entry in the same slot.
+     * Position of entry relative to the oldest one is offs[slot] - offs[out_offs],
+     * unsigned difference stays correct when stream position wraps.
+     */
+    size_t *offs;
+    /**
+     * Stream position after the newest entry
+     */
+    size_t end;
+    /**
+     * Size of entry array minus one
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t mask;
+    /**
+     * Max number of entries stored, the oldest one is replaced after that
+     */
+    uint32_t capacity;
+    /**
+     * Number of stored entries
+     */
+    uint32_t count;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
@@ -58,16 +88,29 @@ extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos
 
 extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern size_t aesd_circular_buffer_entry_offset(struct aesd_circular_buffer *buffer, uint32_t index);
+
+extern size_t aesd_circular_buffer_size(struct aesd_circular_buffer *buffer);
+
+extern size_t aesd_circular_buffer_start(struct aesd_circular_buffer *buffer);
+
+extern bool aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_alloc(struct aesd_circular_buffer *buffer, uint32_t capacity);
+
+extern void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
+ * Slots are visited in storage order, unused slots have NULL buffptr.
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -76,10 +119,10 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            entryptr && index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            entryptr && index<=(buffer)->mask; \
             index++, entryptr=&((buffer)->entry[index]))
 
 #define AESD_CIRCULAR_BUFFER_GET_ENTRY(bufferptr, index) \
-	&(bufferptr->entry[((bufferptr->out_offs)+index) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED])
+	(&((bufferptr)->entry[((bufferptr)->out_offs+(index)) & (bufferptr)->mask]))
 
 #endif /* AESD_CIRCULAR_BUFFER_H */
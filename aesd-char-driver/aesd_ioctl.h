@@ -38,9 +38,14 @@ struct aesd_seekto {
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+/**
+ * Tail mode of open file (uint32_t, 0 - off by default). Reader at the end of data waits
+ * for the next command, or gets EAGAIN with O_NONBLOCK, instead of end of file.
+ */
+#define AESDCHAR_IOCTAIL _IOW(AESD_IOC_MAGIC, 2, uint32_t)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 2
 
 #endif /* AESD_IOCTL_H */
@@ -0,0 +1,52 @@
+/*
+ * aesd_mmap.h
+ *
+ *  @brief Layout of read only mapping of aesd char device (mmap_kb module parameter)
+ *
+ *  Mapping starts with header, data area of commands starts at hdr_size offset.
+ *  Command is never split by the end of data area. Command number n is described
+ *  by slot n & (slots - 1), stored commands are next - count .. next - 1.
+ *
+ *  Header and data are consistent when seq is even and the same before and after
+ *  reading them, as with seqlock:
+ *
+ *      do {
+ *          while ((seq = load_acquire(&hdr->seq)) & 1)
+ *              ;
+ *          ... read slots and data ...
+ *          fence_acquire();
+ *      } while (load(&hdr->seq) != seq);
+ */
+
+#ifndef AESD_MMAP_H
+#define AESD_MMAP_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#define AESD_MMAP_MAGIC 0x44534541	/* "AESD" in little endian */
+
+struct aesd_mmap_slot {
+    /**
+     * Position of command in stream of data area, offset in data area is pos % data_size
+     */
+    uint64_t pos;
+    uint64_t size;
+};
+
+struct aesd_mmap_hdr {
+    uint32_t magic;
+    uint32_t slots;		/* number of slots, power of 2 */
+    uint64_t hdr_size;		/* offset of data area in mapping, page aligned */
+    uint64_t data_size;
+    uint32_t seq;		/* odd while commands change */
+    uint32_t count;		/* number of stored commands */
+    uint64_t next;		/* number of the next command */
+    uint64_t size;		/* bytes of stored commands, size of the device file */
+    struct aesd_mmap_slot slot[];
+};
+
+#endif /* AESD_MMAP_H */
@@ -23,34 +23,60 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
-/* Queue for for storing command*/
 #include "aesd-circular-buffer.h"
-#include "queue.h"
+#include "aesd_mmap.h"
 
+/* Lockless attempts of reader before it excludes writers by circ_buf_lock */
+#define AESD_READ_RETRIES 3
 
-typedef struct qentry_node{
-    aesd_buffer_entry_t *entry;
-    STAILQ_ENTRY(qentry_node) next;
-} qentry_node_t;
+/* First allocation of staging buffer, it grows twice after that */
+#define AESD_STAGE_MIN 64
 
-typedef STAILQ_HEAD(aesd_buffer_entry_queue, qentry_node) queue_t;
+/* Unterminated command. Buffer becomes buffer of the command in circular buffer on newline */
+struct aesd_stage{
+    char *buf;
+    size_t size;		/* amount of data stored in buf */
+    size_t cap;			/* allocated size of buf */
+};
 
 struct aesd_dev{
-    /* Buffer section*/
+    /* Buffer section
+     * writers hold circ_buf_lock and change buffer inside circ_seq write section.
+     * Readers don't lock, they check circ_seq and read command buffers inside srcu
+     * read section, replaced buffers are freed after readers leave it*/
     aesd_circular_buffer_t circ_buf;
     unsigned long circ_buf_size;       /* amount of data stored here */
 	struct mutex circ_buf_lock;
+    seqcount_mutex_t circ_seq;
+    struct srcu_struct srcu;
+    wait_queue_head_t read_wq;		/* tail readers wait for the next command */
 
-    /* Packet section
-     * storing unterminated command
-     related lock*/
-    queue_t queue;
-    size_t queue_size;		/* amount of data stored in queue */
-    struct mutex queue_lock;
-
+    /* Mapped section
+     * with mmap_kb parameter commands are copied to data area of vmalloc'ed mapping
+     * instead of own buffers, header of mapping follows the buffer under circ_seq too*/
+    struct aesd_mmap_hdr *mmap_hdr;	/* start of mapping, NULL - no mapping */
+    char *data;				/* data area of mapping */
+    size_t data_size;
+    uint64_t data_head;		/* stream position of the next command */
 
     struct cdev cdev;     /* Char device structure      */
 };
 
+/* Replaced command buffer waiting for end of srcu grace period, allocated from slab cache */
+struct aesd_dead{
+    struct rcu_head rcu;
+    const char *buf;
+};
+
+/* Open file (private_data), allocated from slab cache.
+ * Writers of different files don't mix fragments of their commands. */
+struct aesd_file{
+    struct aesd_dev *dev;
+    struct aesd_stage stage;	/* unterminated command of this file */
+    struct mutex stage_lock;	/* taken before circ_buf_lock */
+    bool tail;			/* read waits at the end of data, AESDCHAR_IOCTAIL */
+    size_t seen;		/* stream position of file position after the last read or seek */
+};
+
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
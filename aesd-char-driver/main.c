@@ -21,7 +21,18 @@
 #include <linux/fs.h> // file_operations
 #include <linux/uaccess.h>	/* copy_*_user */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/err.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
+#include <linux/moduleparam.h>
+#include <linux/seqlock.h>
+#include <linux/srcu.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>	/* vmalloc_user() */
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/uio.h>	/* iov_iter */
+#include <linux/splice.h>
 
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
@@ -29,378 +40,510 @@
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
+/* Number of commands kept, the oldest command is replaced after that */
+static uint capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(capacity, uint, S_IRUGO);
+MODULE_PARM_DESC(capacity, "Max number of stored commands (default 10)");
+
+/* Byte budget of stored commands, the oldest commands are evicted over it. 0 - no limit */
+static ulong max_bytes = 0;
+module_param(max_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(max_bytes, "Max bytes of stored commands, the newest command is always kept (default 0 - no limit)");
+
+/* Size of mapped data area, commands are copied there. 0 - commands have own buffers, no mmap */
+static uint mmap_kb = 0;
+module_param(mmap_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(mmap_kb, "Size of data area of read only mapping in KiB, commands are stored there (default 0 - no mmap)");
+
 MODULE_AUTHOR("Anton Sidorov");
 MODULE_LICENSE("Dual BSD/GPL");
 
 struct aesd_dev aesd_device;
 
+static struct kmem_cache *aesd_file_cache;
+static struct kmem_cache *aesd_dead_cache;
+
+/**
+ * Make room for count more bytes in staging buffer, it grows twice at least
+ * @return 0 on success, -ENOMEM
+ */
+static int aesd_stage_reserve(struct aesd_stage *stage, size_t count)
+{
+	char *buf;
+	size_t cap;
+
+	if (stage->size + count <= stage->cap)
+		return 0;
+	cap = max(stage->cap * 2, (size_t)AESD_STAGE_MIN);
+	cap = max(cap, stage->size + count);
+	buf = krealloc(stage->buf, cap, GFP_KERNEL);
+	if (!buf){
+		PDEBUG("Error allocate staging buffer of %zu bytes", cap);
+		return -ENOMEM;
+	}
+	PDEBUG("Staging buffer grows to %zu bytes", cap);
+	stage->buf = buf;
+	stage->cap = cap;
+	return 0;
+}
+
 int aesd_open(struct inode *inode, struct file *filp)
 {
-	struct aesd_dev *dev; /* device information */
+	struct aesd_file *file; /* file information */
 
 	PDEBUG("open");
 
-
-	dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-	filp->private_data = dev; /* for other methods */
+	file = kmem_cache_zalloc(aesd_file_cache, GFP_KERNEL);
+	if (!file){
+		PDEBUG("Error allocate file");
+		return -ENOMEM;
+	}
+	file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+	mutex_init(&file->stage_lock);
+	filp->private_data = file; /* for other methods */
 
 	return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
+	struct aesd_file *file = filp->private_data;
+
 	PDEBUG("release");
+
+	// unterminated command belongs to this file only, it is not mixed into commands of other writers
+	if (file->stage.size)
+		PDEBUG("Unterminated command of %zu bytes dropped", file->stage.size);
+	kfree(file->stage.buf);
+	mutex_destroy(&file->stage_lock);
+	kmem_cache_free(aesd_file_cache, file);
 	return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
     ssize_t retval = 0;
 
-    struct aesd_dev *dev = filp->private_data;
-
-    const char *pos;
+    struct file *filp = iocb->ki_filp;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
 
     aesd_buffer_entry_t *entry = NULL;
+    aesd_buffer_entry_t cmd;	// entry copy, checked by circ_seq
     size_t offs_entry; // for getting offset inside entry
-    size_t offs_full; //for avoiding "transfer" pointer and calculations
+    size_t offs_start, offs_full; //for avoiding "transfer" pointer and calculations
+    size_t count = iov_iter_count(to);
+    size_t copied = 0, chunk, chunk_copied;
+    size_t start, size, want = 0; // stream positions of the oldest command and to continue from
+    bool follow = false;	// tail reader continues from stream position want
+    unsigned int seq, tries = 0;
+    bool locked = false;
+    int idx;
 
-	PDEBUG("Read %zu bytes with offset %lld",count,*f_pos);
+	PDEBUG("Read %zu bytes with offset %lld",count,iocb->ki_pos);
 
-	if (mutex_lock_interruptible(&dev->circ_buf_lock))
-		return -ERESTARTSYS;
+	offs_start = iocb->ki_pos;
 
-	if (f_pos)
-		offs_full = *f_pos;
-	else
-		offs_full = filp->f_pos;
+	// command buffers stay allocated until reader leaves srcu section
+	idx = srcu_read_lock(&dev->srcu);
 
-	entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->circ_buf, offs_full, &offs_entry);
-	if (!entry){ //Entry not found
-		PDEBUG("entry not found");
-		retval=0;
-		goto out;
-	}
-
-	/* Calculate size to return. Return no more than one command (till end entry buffer)*/
-	if ((entry->size - offs_entry) < count){
-		PDEBUG("reduce out count. Till end of entry buffer (end of command)");
-		count = entry->size - offs_entry;
+	retry:
+	// reader excludes writers after several retries, so it finishes under write load
+	if (++tries > AESD_READ_RETRIES && !locked){
+		if (mutex_lock_interruptible(&dev->circ_buf_lock)){
+			retval = -ERESTARTSYS;
+			goto out;
+		}
+		locked = true;
 	}
-
-	PDEBUG("%zu bytes will be copied to user", count);
-
-	pos = entry->buffptr + offs_entry;
-
-	PDEBUG("%s will be copied to user", pos);
-
-	if (!pos){
-		PDEBUG("buffer is NULL");
-		goto out;
+	// data of changed buffer is read again into the same user buffers
+	iov_iter_revert(to, copied);
+	copied = 0;
+	seq = read_seqcount_begin(&dev->circ_seq);
+	start = aesd_circular_buffer_start(&dev->circ_buf);
+	size = dev->circ_buf_size;
+	offs_full = offs_start;
+	// evicted commands move file positions, stream position stays. Lost commands are skipped
+	if (follow)
+		offs_full = want - start <= size ? want - start : 0;
+
+	/* Fill user buffer across commands. All commands are from one version of buffer */
+	while (copied < count){
+		entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->circ_buf, offs_full, &offs_entry);
+		if (entry)
+			cmd = *entry;
+		if (read_seqcount_retry(&dev->circ_seq, seq)){
+			PDEBUG("buffer changed, read again");
+			goto retry;
+		}
+		if (!entry)
+			break;
+		chunk = min(cmd.size - offs_entry, count - copied);
+		// user buffers of readv or pages of pipe for splice
+		chunk_copied = copy_to_iter(cmd.buffptr + offs_entry, chunk, to);
+		copied += chunk_copied;
+		offs_full += chunk_copied;
+		// data area of mapping is reused by new commands, copied data must be checked too
+		if (dev->data && read_seqcount_retry(&dev->circ_seq, seq)){
+			PDEBUG("command overwritten, read again");
+			goto retry;
+		}
+		if (chunk_copied < chunk){
+			PDEBUG("fail copy to user");
+			break;
+		}
 	}
 
-	retval = copy_to_user(buf, pos, count);
-	if (retval) {
-		PDEBUG("fail copy to user");
+	// fault after some data returns short read, like any file
+	if (!copied && entry && count){
 		retval = -EFAULT;
 		goto out;
 	}
 
-	offs_full += count; // for correct printk
-	*f_pos = offs_full; //
-	//filp -> f_pos = offs_full; //readp must don't change file position
-	// TODO changing fileposition in case of read call (file position should be changed)
-	// maybe it makes kernel
+	// tail reader at the end of data waits for the next command
+	if (!copied && count && file->tail){
+		// commands after the last read were shifted under file position by evictions
+		if (!follow && file->seen != start + size){
+			want = file->seen;
+			follow = true;
+			goto retry;
+		}
+		if (filp->f_flags & O_NONBLOCK){
+			retval = -EAGAIN;
+			goto out;
+		}
+		want = start + size;
+		follow = true;
+		if (locked)
+			mutex_unlock(&dev->circ_buf_lock);
+		locked = false;
+		tries = 0;
+		// sleeping reader doesn't hold back freeing of replaced commands
+		srcu_read_unlock(&dev->srcu, idx);
+		PDEBUG("wait for command after %zu", want);
+		if (wait_event_interruptible(dev->read_wq, READ_ONCE(dev->circ_buf.end) != want))
+			return -ERESTARTSYS;
+		idx = srcu_read_lock(&dev->srcu);
+		goto retry;
+	}
 
-	retval = count;
+	iocb->ki_pos = offs_full;
+	file->seen = start + offs_full;
+	retval = copied;
 	PDEBUG("new value of f_pos arg is %zu ", offs_full);
 
-
-
-	out: mutex_unlock(&dev->circ_buf_lock);
-	PDEBUG("aesd_read returns %zu ", retval);
+	out: if (locked)
+		mutex_unlock(&dev->circ_buf_lock);
+	srcu_read_unlock(&dev->srcu, idx);
+	PDEBUG("aesd_read returns %zd ", retval);
 	return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+static void aesd_free_dead(struct rcu_head *rcu)
 {
+	struct aesd_dead *dead = container_of(rcu, struct aesd_dead, rcu);
 
-    ssize_t retval = -ENOMEM;
-
-	struct aesd_dev *dev = filp->private_data;
-
-	uint8_t packet = 0;
-	char *pos=NULL; // pointer for fill full command(moving inside buffptr)
-
-	qentry_node_t *node = NULL;	//queue node, which points to short (working) entry to store in/get from queue
-	aesd_buffer_entry_t *full_cmd = NULL;	//long entry for adding to circular buffer
-	const aesd_buffer_entry_t *del_cmd;	//for temporary save entry that will be deleted
-
-	char *full_buf = NULL; // buffer to collect full command
-	void *del_buf = NULL; // to save pointer to free memory
+	kfree(dead->buf);
+	kmem_cache_free(aesd_dead_cache, dead);
+}
 
-	size_t buf_size = count*sizeof(char);
-	char *buffer = kzalloc(buf_size+1, GFP_KERNEL);
+/**
+ * Holder of command buffer to be replaced, taken before the buffer changes.
+ * Writer never waits for readers under circ_buf_lock: a reader out of retries takes the lock
+ * inside srcu read section. NULL - buffers are in data area of mapping, nothing to free.
+ * @return holder, ERR_PTR(-ENOMEM)
+ */
+static struct aesd_dead *aesd_dead_alloc(struct aesd_dev *dev)
+{
+	struct aesd_dead *dead;
+
+	if (dev->data)
+		return NULL;
+	dead = kmem_cache_alloc(aesd_dead_cache, GFP_KERNEL);
+	if (!dead){
+		PDEBUG("Error allocate holder of replaced command");
+		return ERR_PTR(-ENOMEM);
+	}
+	return dead;
+}
 
+/**
+ * Free command buffer removed from circular buffer when readers can't access it.
+ * Caller is not inside circ_seq write section.
+ */
+static void aesd_retire(struct aesd_dev *dev, struct aesd_dead *dead, const char *buf)
+{
+	if (!dead)
+		return;
+	dead->buf = buf;
+	call_srcu(&dev->srcu, &dead->rcu, aesd_free_dead);
+}
 
-	PDEBUG("write %zu bytes with offset %lld", buf_size,*f_pos);
+/**
+ * Start change of circular buffer, seq of mapped header is odd until aesd_change_end
+ */
+static void aesd_change_begin(struct aesd_dev *dev)
+{
+	write_seqcount_begin(&dev->circ_seq);
+	if (dev->mmap_hdr){
+		WRITE_ONCE(dev->mmap_hdr->seq, dev->mmap_hdr->seq + 1);
+		smp_wmb();
+	}
+}
 
+static void aesd_change_end(struct aesd_dev *dev)
+{
+	struct aesd_mmap_hdr *hdr = dev->mmap_hdr;
 
-	if (!buffer){
-		PDEBUG("Error allocate buffer for write data");
-		retval = -ENOMEM;
-		goto clean_buf;
+	if (hdr){
+		hdr->count = dev->circ_buf.count;
+		hdr->size = dev->circ_buf_size;
+		smp_wmb();
+		WRITE_ONCE(hdr->seq, hdr->seq + 1);
 	}
-	PDEBUG("For short buffer allocated %zu bytes", ksize(buffer));
-	//memset(buffer, 0, ksize(buffer));
+	write_seqcount_end(&dev->circ_seq);
+}
 
-	if (copy_from_user(buffer, buf, buf_size)){
-		retval = -EFAULT;
-		PDEBUG("Error copy from user buf");
-		goto clean_buf;
+/**
+ * Copy command to data area of mapping, commands overwritten by it are evicted.
+ * Caller is inside change of circular buffer.
+ * @return entry of the command in data area
+ */
+static aesd_buffer_entry_t aesd_place(struct aesd_dev *dev, const char *data, size_t size, uint64_t pos)
+{
+	struct aesd_mmap_hdr *hdr = dev->mmap_hdr;
+	aesd_circular_buffer_t *circ_buf = &dev->circ_buf;
+	aesd_buffer_entry_t cmd = {dev->data + pos % dev->data_size, size};
+	aesd_buffer_entry_t evicted;
+	struct aesd_mmap_slot *slot;
+
+	// stored commands are within data_size behind the head
+	while (circ_buf->count && (circ_buf->full ||
+	       hdr->slot[circ_buf->out_offs].pos + dev->data_size < pos + size)){
+		aesd_circular_buffer_remove_entry(circ_buf, &evicted);
+		dev->circ_buf_size -= evicted.size;
 	}
+	memcpy((char *)cmd.buffptr, data, size);
+	slot = &hdr->slot[circ_buf->in_offs];
+	slot->pos = pos;
+	slot->size = size;
+	hdr->next++;
+	dev->data_head = pos + size;
+	return cmd;
+}
 
-	 PDEBUG("%s copied from user", buffer);
-
-	// if neccessary trim buf. Then check last symbol in entry buf will work
-	if((pos = strchr(buffer,'\n'))){
-		PDEBUG("End line found");
-		if (((pos-buffer)+1)*sizeof(char) < buf_size){
-			memset(pos+1, 0, buf_size - (pos-buffer)*sizeof(char));
-			buf_size = (pos-buffer+1)*sizeof(char);
-			PDEBUG("Data trimmed");
-		}
-		pos = NULL;
+/**
+ * Add command to circular buffer. Buffer of data is owned by circular buffer after that,
+ * with mapping data is copied to data area and stays with caller.
+ * Replaced and evicted commands are freed after readers leave them. Caller must hold circ_buf_lock.
+ * @return 0 on success, -EFBIG if command doesn't fit data area of mapping,
+ * -ENOMEM if command replaces the oldest one and there is no memory for holder of it
+ */
+static int aesd_commit(struct aesd_dev *dev, char *data, size_t size)
+{
+	aesd_buffer_entry_t cmd = {data, size};
+	aesd_buffer_entry_t evicted = {NULL, 0};
+	struct aesd_dead *dead = NULL;
+	uint64_t pos = dev->data_head;
+
+	if (dev->data){
+		if (size > dev->data_size)
+			return -EFBIG;
+		// command is not split by the end of data area, the rest of lap is skipped
+		if (pos % dev->data_size + size > dev->data_size)
+			pos += dev->data_size - pos % dev->data_size;
+	}
+	else if (dev->circ_buf.full){
+		dead = aesd_dead_alloc(dev);
+		if (IS_ERR(dead))
+			return PTR_ERR(dead);
 	}
-	retval = buf_size;
-
 
-	node = kzalloc(sizeof(qentry_node_t), GFP_KERNEL);
-	if (!node){
-		PDEBUG("Error allocate node");
-		retval = -ENOMEM;
-		goto clean_buf;
+	aesd_change_begin(dev);
+	if (dev->data)
+		cmd = aesd_place(dev, data, size, pos);
+	else if (dev->circ_buf.full){
+		// We need free memory from first command in buffer
+		aesd_circular_buffer_remove_entry(&dev->circ_buf, &evicted);
+		// reduce full size of buffer
+		dev->circ_buf_size -= evicted.size;
 	}
-	PDEBUG("For node allocated %zu bytes", ksize(node));
-	//memset(node, 0, ksize(node));
-
-	node->entry = kzalloc(sizeof(aesd_buffer_entry_t), GFP_KERNEL);
-	if (!node->entry){
-		PDEBUG("Allocate entry");
-		retval = -ENOMEM;
-		goto clean_node;
+	PDEBUG("Save command in buf at %p", cmd.buffptr);
+	aesd_circular_buffer_add_entry(&dev->circ_buf, &cmd);
+	// add to full size length of new command
+	dev->circ_buf_size += size;
+	aesd_change_end(dev);
+	aesd_retire(dev, dead, evicted.buffptr);
+	wake_up_interruptible(&dev->read_wq);
+
+	// evict the oldest commands over byte budget, the new one stays.
+	// Without memory for holder the budget is exceeded until the next command
+	while (max_bytes && dev->circ_buf_size > max_bytes && dev->circ_buf.count > 1){
+		dead = aesd_dead_alloc(dev);
+		if (IS_ERR(dead))
+			break;
+		aesd_change_begin(dev);
+		aesd_circular_buffer_remove_entry(&dev->circ_buf, &evicted);
+		dev->circ_buf_size -= evicted.size;
+		aesd_change_end(dev);
+		PDEBUG("Evict command at %p over byte budget", evicted.buffptr);
+		aesd_retire(dev, dead, evicted.buffptr);
 	}
-	PDEBUG("For node->entry allocated %zu bytes", ksize(node->entry));
-	//memset(node->entry, 0, ksize(node->entry));
-
-	node->entry->buffptr = buffer;
-	node->entry->size = buf_size;
-	// Store buffer to clear memory in case of fail
+	return 0;
+}
 
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	ssize_t retval = -ENOMEM;
 
+	struct aesd_file *file = iocb->ki_filp->private_data;
+	struct aesd_dev *dev = file->dev;
+	struct aesd_stage *stage = &file->stage;
 
-	// add full command to circular buffer
-	// check can pass. Buffer should be cut at beginning of function
-	if (node->entry->buffptr[node->entry->size - 1] == '\n'){
-		PDEBUG("Make entry for circular buffer. New line symbol found");
-		full_cmd = kzalloc(sizeof(aesd_buffer_entry_t), GFP_KERNEL);
-		if (!full_cmd){
-			PDEBUG("Error allocation entry for full command");
-			retval = -ENOMEM;
-			goto clean_entry;
-		}
-		PDEBUG("For full command entry allocated %zu bytes", ksize(full_cmd));
-		//memset(full_cmd, 0, ksize(full_cmd));
-
-		full_buf = kzalloc((dev->queue_size + node->entry->size)+1, GFP_KERNEL);
-		if (!full_buf){
-			retval = -ENOMEM;
-			PDEBUG("Error allocate full command buffer");
-			goto clean_full_cmd;
-		}
-		PDEBUG("For full command (long) buffer allocated %zu bytes", ksize(full_buf));
-		full_cmd->size = dev->queue_size + node->entry->size;
-		//memset(full_buf, 0, ksize(full_cmd));
+	char *pos = NULL; // pointer to new data in staging buffer
+	const char *nl = NULL;
+	char *cmd = NULL;
+	size_t count = iov_iter_count(from); // all segments of writev are one write
+	size_t start = 0, end, size; // committed data and end of data in staging buffer
+	int err = 0;
 
-		packet = 1;
-	}
+	PDEBUG("write %zu bytes with offset %lld", count, iocb->ki_pos);
 
+	if (mutex_lock_interruptible(&file->stage_lock))
+		return -ERESTARTSYS;
 
+	// user data goes straight to staging buffer, no copy after that
+	if ((retval = aesd_stage_reserve(stage, count)))
+		goto out;
 
-	// in case of full packet last part will be added only if all allocation succeeded
-	// caller gets the error and has ability resend (retry) last part and fulfill command
-	if (mutex_lock_interruptible(&dev->queue_lock)){
-		retval = -ERESTARTSYS;
-		PDEBUG("Error lock mutex for queue");
-		goto clean_full_buffptr; // don't danger free in case of packet=0 so as
-								// full_cmd=full_cmd->buffptr=NULL
+	pos = stage->buf + stage->size;
+	if (copy_from_iter(pos, count, from) != count){
+		PDEBUG("Error copy from user buf");
+		retval = -EFAULT;
+		goto out;
 	}
 
-	PDEBUG("Add to queue");
-	if (STAILQ_EMPTY(&dev->queue)){
-		STAILQ_NEXT(node, next) = NULL;
-		STAILQ_INSERT_HEAD(&dev->queue,node, next);
+	end = stage->size + count;
+	if (!memchr(pos, '\n', count)){
+		stage->size = end;
+		retval = count;
+		goto out;
 	}
-	else
-		STAILQ_INSERT_TAIL(&dev->queue, node, next);
-
-	// collect full size of packet
-	dev->queue_size += node->entry->size;
-
-	mutex_unlock(&dev->queue_lock);
-
-
-
-	// here should be all allocation success. Add command to circular buffer
-	if (packet){
 
-		if (mutex_lock_interruptible(&dev->queue_lock)){
-			PDEBUG("Error lock  mutex for queue. Making full command entry, clean queue.");
-			retval = -ERESTARTSYS;
-			goto clean_full_buffptr;
-		}
-
-		PDEBUG("From queue to circular buffer");
-		pos = full_buf;
-
-		// Make full command from queue
-		while(!STAILQ_EMPTY(&dev->queue)){
-			node = STAILQ_FIRST(&dev->queue);
-			STAILQ_REMOVE_HEAD(&dev->queue, next);
-
-			if(memcpy(pos, node->entry->buffptr, node->entry->size) == NULL){
-				PDEBUG("Error copy to full command buffer");
-				retval= -EFAULT;
+	// all commands of the write are committed at once
+	if (mutex_lock_interruptible(&dev->circ_buf_lock)){
+		PDEBUG("Error lock circular buffer for write full command");
+		retval = -ERESTARTSYS;
+		goto out;
+	}
+	if (dev->data){
+		// commands are copied to data area of mapping, staging buffer stays with the file
+		while ((nl = memchr(stage->buf + start, '\n', end - start))){
+			size = nl - (stage->buf + start) + 1;
+			if ((err = aesd_commit(dev, stage->buf + start, size))){
+				PDEBUG("Command of %zu bytes doesn't fit data area", size);
+				break;
 			}
-			pos += node->entry->size;
-			kfree(node->entry->buffptr);
-			kfree(node->entry);
-			kfree(node);
-			node = NULL;
-		}
-
-		dev->queue_size = 0; //queue_size is part of packet(queue). Access must be locked
-		pos = NULL;
-
-		mutex_unlock(&dev->queue_lock);
-
-
-
-		if (mutex_lock_interruptible(&dev->circ_buf_lock)){
-			PDEBUG("Error lock circular buffer for write full command");
-			retval = -ERESTARTSYS;
-			goto clean_full_buffptr;
+			start += size;
 		}
-
-		PDEBUG("Add to circular buffer %s", full_buf);
-
-		if (dev->circ_buf.full){
-			// We need free memory from first command in buffer
-			del_cmd = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->circ_buf, 0, NULL);
-			del_buf = (void *)(del_cmd->buffptr);
-			// reduce full size of buffer
-			dev->circ_buf_size -= del_cmd->size;
+	}
+	else if (memchr(stage->buf, '\n', end) == stage->buf + end - 1){
+		PDEBUG("End line found");
+		// single command, staging buffer is handed to circular buffer as is
+		if (!(err = aesd_commit(dev, stage->buf, end))){
+			memset(stage, 0, sizeof(*stage));
+			start = end;
 		}
-
-		PDEBUG("Save command in buf at %p", full_buf);
-		full_cmd->buffptr = full_buf;
-		aesd_circular_buffer_add_entry(&dev->circ_buf, full_cmd);
-		// add to full size length of new command
-		dev->circ_buf_size += full_cmd->size;
-
-		// data from full_cmd copied to circular buf
-		// here free full_cmd
-		kfree(full_cmd);
-		full_cmd = NULL;
-
-		// here full_cmd already replaced in circular buffer entry, which we stored in del_entry
-		if(del_buf){ //here del_cmd NULL or saved entry
-		// if buffer not full del_cmd will NULL it's important for first free access to member
-			PDEBUG("Free replaced command at %p", del_buf);
-			kfree(del_buf);
-			//kfree(del_cmd);
-			del_buf=NULL;
+	}
+	else{
+		// every command gets buffer of its size, staging buffer keeps unterminated tail
+		while ((nl = memchr(stage->buf + start, '\n', end - start))){
+			size = nl - (stage->buf + start) + 1;
+			if (!(cmd = kmemdup(stage->buf + start, size, GFP_KERNEL))){
+				PDEBUG("Error allocate command of %zu bytes", size);
+				err = -ENOMEM;
+				break;
+			}
+			if ((err = aesd_commit(dev, cmd, size))){
+				kfree(cmd);
+				break;
+			}
+			start += size;
 		}
-
-		mutex_unlock(&dev->circ_buf_lock);
-
-
-		packet = 0;
 	}
+	mutex_unlock(&dev->circ_buf_lock);
 
-	return retval; // All allocated data in use. Return here.
-
-	// Cleanup in case of errors.
-	clean_full_buffptr: kfree(full_buf);
-	clean_full_cmd: kfree(full_cmd);
-	clean_entry: kfree(node->entry);
-	clean_node:	kfree(node);
-	clean_buf: kfree(buffer);
+	if (!start){
+		// too long command is dropped, it can't be stored ever
+		if (err == -EFBIG)
+			stage->size = 0;
+		retval = err;
+		goto out;
+	}
+	// data after committed commands is not accepted on error, caller writes it again
+	if (err){
+		retval = start - stage->size;
+		stage->size = 0;
+		goto out;
+	}
+	if (stage->buf){
+		memmove(stage->buf, stage->buf + start, end - start);
+		stage->size = end - start;
+	}
+	retval = count;
 
+	out: mutex_unlock(&file->stage_lock);
 	return retval;
 }
 
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence){
-	struct aesd_dev *dev = filp->private_data;
-	loff_t offs;
+	struct aesd_file *file = filp->private_data;
+	struct aesd_dev *dev = file->dev;
+	loff_t offs, size;
+	size_t start;
+	unsigned int seq;
 	PDEBUG("Seek to %lld. relative %d", offset, whence);
-	if (mutex_lock_interruptible(&dev->circ_buf_lock)){
-		PDEBUG("Error lock for seek");
-		return -ERESTARTSYS;
-	}
-	offs = fixed_size_llseek(filp, offset, whence,dev->circ_buf_size);
+	do {
+		seq = read_seqcount_begin(&dev->circ_seq);
+		start = aesd_circular_buffer_start(&dev->circ_buf);
+		size = dev->circ_buf_size;
+	} while (read_seqcount_retry(&dev->circ_seq, seq));
+	offs = fixed_size_llseek(filp, offset, whence, size);
+	if (offs >= 0)
+		file->seen = start + offs;
 	PDEBUG("seek returns %lld. File->pos is %lld", offs, filp->f_pos);
-	mutex_unlock(&dev->circ_buf_lock);
 	return offs;
 }
 
 static long aesd_adjust_file_offset(struct file *filp, uint32_t write_cmd, uint32_t write_cmd_offset){
-	struct aesd_dev *dev = filp->private_data;
+	struct aesd_file *file = filp->private_data;
+	struct aesd_dev *dev = file->dev;
 	struct aesd_circular_buffer *circ_buf = &(dev->circ_buf);
 	struct aesd_buffer_entry *entry = NULL;
-	size_t full_offs = 0;
-	uint8_t i=0;
+	size_t full_offs = 0, size = 0;
+	unsigned int seq;
+	bool valid;
 	long retval=0;
 
 	PDEBUG("Adjust file offset with command %d, offset %d", write_cmd, write_cmd_offset);
 
-	if (write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED){
-		PDEBUG("write command number to large");
-		return -EINVAL;
-	}
-
-	//make f_pos base from command number
-	//collect from previous commands
-	for ( i = 0; i < write_cmd; i ++){
-		entry = AESD_CIRCULAR_BUFFER_GET_ENTRY(circ_buf, i);
-		if (entry){
-			if (entry->buffptr)
-				full_offs += entry->size;
-			else
-				break;
-		}
-		else{
-			break;
+	do {
+		seq = read_seqcount_begin(&dev->circ_seq);
+		valid = write_cmd < circ_buf->count;
+		if (valid){
+			entry = AESD_CIRCULAR_BUFFER_GET_ENTRY(circ_buf, write_cmd);
+			size = entry->size;
+			// prefix sums of the buffer give offset of command without walk
+			full_offs = aesd_circular_buffer_entry_offset(circ_buf, write_cmd);
 		}
-	}
+	} while (read_seqcount_retry(&dev->circ_seq, seq));
 
-	if (i < write_cmd){
+	if (!valid){
 		PDEBUG("Not enough commands written");
 		return -EINVAL;
 	}
 
-	entry = AESD_CIRCULAR_BUFFER_GET_ENTRY(circ_buf, write_cmd);
-
-	// entry is static as part of global device structure ( aesd_device.circ_buf.entry[write_cmd])
-	// so check for NULL is not necessary
-	if (!entry->buffptr){
-		PDEBUG("Not enough commands written");
-		return -EINVAL;
-	}
-
-	if (write_cmd_offset >= entry -> size){
+	if (write_cmd_offset >= size){
 		PDEBUG("Offset in command larger then command size");
 		return -EINVAL;
 	}
@@ -442,6 +585,19 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
 			}
 			break;
 		}
+		case AESDCHAR_IOCTAIL:
+		{
+			struct aesd_file *file = filp->private_data;
+			uint32_t tail;
+			loff_t offs;
+			if (get_user(tail, (uint32_t __user *) arg))
+				return -EFAULT;
+			file->tail = tail;
+			// tail starts after data before file position
+			offs = aesd_llseek(filp, 0, SEEK_CUR);
+			retval = offs < 0 ? offs : 0;
+			break;
+		}
 		default:
 			retval = -ENOTTY;
 	}
@@ -449,14 +605,86 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
 	return retval;
 }
 
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct aesd_file *file = filp->private_data;
+	struct aesd_dev *dev = file->dev;
+
+	PDEBUG("mmap %lu bytes at page %lu", vma->vm_end - vma->vm_start, vma->vm_pgoff);
+
+	if (!dev->mmap_hdr)
+		return -ENODEV;
+	// commands are added by write only
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	return remap_vmalloc_range(vma, dev->mmap_hdr, vma->vm_pgoff);
+}
+
+/**
+ * Allocate mapping with header and data area of data_size bytes at least
+ * @return 0 on success, -ENOMEM
+ */
+static int aesd_mmap_alloc(struct aesd_dev *dev, size_t data_size)
+{
+	struct aesd_mmap_hdr *hdr;
+	uint32_t slots = dev->circ_buf.mask + 1;
+	size_t hdr_size = PAGE_ALIGN(struct_size(hdr, slot, slots));
+
+	data_size = PAGE_ALIGN(data_size);
+	// zeroed memory, mapping doesn't show old kernel data
+	hdr = vmalloc_user(hdr_size + data_size);
+	if (!hdr)
+		return -ENOMEM;
+	hdr->magic = AESD_MMAP_MAGIC;
+	hdr->slots = slots;
+	hdr->hdr_size = hdr_size;
+	hdr->data_size = data_size;
+	dev->mmap_hdr = hdr;
+	dev->data = (char *)hdr + hdr_size;
+	dev->data_size = data_size;
+	return 0;
+}
+
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+	struct aesd_file *file = filp->private_data;
+	struct aesd_dev *dev = file->dev;
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;	// write never waits for readers
+	size_t start, size;
+	unsigned int seq;
+
+	poll_wait(filp, &dev->read_wq, wait);
+	do {
+		seq = read_seqcount_begin(&dev->circ_seq);
+		start = aesd_circular_buffer_start(&dev->circ_buf);
+		size = dev->circ_buf_size;
+	} while (read_seqcount_retry(&dev->circ_seq, seq));
+	// read doesn't wait: end of file or data after the last read
+	if (!file->tail || filp->f_pos < size || file->seen != start + size)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	return mask;
+}
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter =    aesd_read_iter,
+    .write_iter =   aesd_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read =  copy_splice_read,
+#else
+    .splice_read =  generic_file_splice_read,
+#endif
     .open =     aesd_open,
     .release =  aesd_release,
     .llseek =   aesd_llseek,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
 };
 
 static int aesd_setup_cdev(struct aesd_dev *dev)
@@ -491,17 +719,44 @@ int aesd_init_module(void)
     /**
      * TODO: initialize the AESD specific portion of the device
      */
-	aesd_circular_buffer_init(&aesd_device.circ_buf);
+	result = aesd_circular_buffer_alloc(&aesd_device.circ_buf, capacity);
+	if (result){
+		printk(KERN_WARNING "Can't allocate buffer for %u commands\n", capacity);
+		goto clean_region;
+	}
+	if (mmap_kb){
+		result = aesd_mmap_alloc(&aesd_device, (size_t)mmap_kb * 1024);
+		if (result){
+			printk(KERN_WARNING "Can't allocate mapping of %u KiB\n", mmap_kb);
+			goto clean_buf;
+		}
+	}
 	// aesd_device.circ_buf_size = 0; should be after memset
 	mutex_init(&aesd_device.circ_buf_lock);
+	seqcount_mutex_init(&aesd_device.circ_seq, &aesd_device.circ_buf_lock);
+	init_waitqueue_head(&aesd_device.read_wq);
+	result = init_srcu_struct(&aesd_device.srcu);
+	if (result)
+		goto clean_buf;
 
-	STAILQ_INIT(&aesd_device.queue);
-	mutex_init(&aesd_device.queue_lock);
+	result = -ENOMEM;
+	aesd_file_cache = KMEM_CACHE(aesd_file, 0);
+	aesd_dead_cache = KMEM_CACHE(aesd_dead, 0);
+	if (!aesd_file_cache || !aesd_dead_cache){
+		printk(KERN_WARNING "Can't create slab caches\n");
+		goto clean_cache;
+	}
     result = aesd_setup_cdev(&aesd_device);
-
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
-    }
+    if( result )
+        goto clean_cache;
+    return 0;
+
+    clean_cache: kmem_cache_destroy(aesd_dead_cache);
+    kmem_cache_destroy(aesd_file_cache);
+    cleanup_srcu_struct(&aesd_device.srcu);
+    clean_buf: vfree(aesd_device.mmap_hdr);
+    aesd_circular_buffer_free(&aesd_device.circ_buf);
+    clean_region: unregister_chrdev_region(dev, 1);
     return result;
 
 }
@@ -511,38 +766,34 @@ void aesd_cleanup_module(void)
 	dev_t devno = MKDEV(aesd_major, aesd_minor);
 
 	aesd_buffer_entry_t *entry=NULL;
-	uint8_t i=0;
-
-	qentry_node_t *node = NULL;
+	uint32_t i=0;
 
 	cdev_del(&aesd_device.cdev);
 
 
-	PDEBUG("Queue clean");
+	PDEBUG("Staging buffer clean");
 
-	while(!STAILQ_EMPTY(&aesd_device.queue)){
-		node = STAILQ_FIRST(&aesd_device.queue);
-		STAILQ_REMOVE_HEAD(&aesd_device.queue, next);
-
-		kfree(node->entry->buffptr);
-		kfree(node->entry);
-		kfree(node);
-		node = NULL;
-	}
-
-	PDEBUG("Bring queue to initial (null) state");
-	STAILQ_INIT(&aesd_device.queue);
-	aesd_device.queue_size = 0;
+	// files are closed before module is unloaded
+	kmem_cache_destroy(aesd_file_cache);
 
 	PDEBUG("Clean Circular Buffer");
 
-	AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.circ_buf,i){
-		kfree(entry->buffptr);
-		//kfree(entry);
-		entry = NULL;
-	}
+	// replaced commands are freed by srcu callbacks
+	srcu_barrier(&aesd_device.srcu);
+	cleanup_srcu_struct(&aesd_device.srcu);
+	kmem_cache_destroy(aesd_dead_cache);
+
+	// commands in data area of mapping go with it
+	if (!aesd_device.data)
+		AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.circ_buf,i){
+			kfree(entry->buffptr);
+			//kfree(entry);
+			entry = NULL;
+		}
 	PDEBUG("Circular buffer clean all pointers to avoid access");
-	aesd_circular_buffer_init(&aesd_device.circ_buf);
+	vfree(aesd_device.mmap_hdr);
+	aesd_circular_buffer_free(&aesd_device.circ_buf);
+	aesd_device.circ_buf_size = 0;
 
     unregister_chrdev_region(devno, 1);
 }
@@ -2,25 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include "aesd-circular-buffer.h"
-#include "queue.h" // for data structures like single linked list, single linked queue etc.
 
-/* Data structures and queue */
+/* Staging buffer of unterminated command */
 
-typedef struct qentry{
-    char* buffptr;
-    size_t size;
-} qentry_t;
+#define AESD_STAGE_MIN 64
 
-typedef struct qentry_node{
-    aesd_buffer_entry_t *entry;
-    STAILQ_ENTRY(qentry_node) next;
-} qentry_node_t;
-
-
-typedef STAILQ_HEAD(aesd_buffer_entry_queue, qentry_node) queue_t;
-
-queue_t queue = STAILQ_HEAD_INITIALIZER(queue);
-size_t queue_size=0;
+char *stage = NULL;
+size_t stage_size = 0;
+size_t stage_cap = 0;
 
 aesd_circular_buffer_t *circ_buf;
 
@@ -29,167 +18,88 @@ aesd_circular_buffer_t *circ_buf;
 ****************************************************************/
 
 
-ssize_t aesd_write(const char *ubuf, size_t count, size_t *f_pos)
+static void commit(char *data, size_t size)
 {
+	aesd_buffer_entry_t cmd = {data, size}, evicted;
 
-	// TODO change error codes to constants
-	ssize_t retval = -1;
-	uint8_t packet = 0;
-
-	char *pos = NULL;
-
-	qentry_node_t *node=NULL;
-	aesd_buffer_entry_t *full_cmd;
-
-	char *full_buf=NULL;
-	void *del_buf=NULL; // to save pointer to free memory
-
-	size_t buf_size = count*sizeof(char);
-
-	//TODO kmalloc
-	char *buf = malloc(buf_size);
-
-	if (!buf){
-		perror("Error allocate buffer for write data");
-		goto clean_buf;
-	}
-	memset(buf, 0, buf_size);
-
-	// TODO retval = copy_from_user()
-	// TODO PDEBUG size of copied
-	if (memcpy(buf, ubuf, buf_size) == NULL){
-		perror("Error copy from user buf");
-		goto clean_buf;
+	if (circ_buf->full){
+		// We need free memory from first command in buffer
+		aesd_circular_buffer_remove_entry(circ_buf, &evicted);
+		free((void *)evicted.buffptr);
 	}
+	aesd_circular_buffer_add_entry(circ_buf, &cmd);
+}
 
-
-	// if neccessary trim buf. Then check last symbol in entry buf will work
-	if((pos = strchr(buf,'\n'))){
-		if (((pos-buf)+1)*sizeof(char) < buf_size){
-			memset(pos+1, 0, buf_size - (pos-buf)*sizeof(char));
-			buf_size = (pos-buf+1)*sizeof(char);
+ssize_t aesd_write(const char *ubuf, size_t count, size_t *f_pos)
+{
+	const char *nl = NULL;
+	char *pos = NULL;
+	char *new_stage = NULL;
+	char *cmd = NULL;
+	size_t cap, start = 0, end, size;
+
+	// TODO lock stage
+	if (stage_size + count > stage_cap){
+		cap = stage_cap * 2 > AESD_STAGE_MIN ? stage_cap * 2 : AESD_STAGE_MIN;
+		if (cap < stage_size + count)
+			cap = stage_size + count;
+		// TODO krealloc
+		new_stage = realloc(stage, cap);
+		if (!new_stage){
+			perror("Error allocate staging buffer");
+			return -1;
 		}
-		pos = NULL;
-	}
-	retval = buf_size;
-
-	// TODO change go kmalloc
-	node = malloc(sizeof(qentry_node_t));
-	if (!node){
-		perror("Error allocate node");
-		goto clean_buf;
-	}
-	memset(node, 0, sizeof(qentry_node_t));
-
-	// TODO change go kmalloc
-	node->entry = malloc(sizeof(aesd_buffer_entry_t));
-	if (!node->entry){
-		perror("Allocate entry");
-		goto clean_node;
+		stage = new_stage;
+		stage_cap = cap;
 	}
-	memset(node->entry, 0, sizeof(aesd_buffer_entry_t));
-
-	node->entry->buffptr = buf;
-	node->entry->size = buf_size;
-	// Store buf to clear memory in case of fail
-
-
-	// add full command to circular buffer
-	// check can pass. Buffer should be cut at beginning of function
-	if (node->entry->buffptr[node->entry->size - 1] == '\n'){
-		// TODO change go kmalloc
-
-		full_cmd = malloc(sizeof(aesd_buffer_entry_t));
-		if (!full_cmd){
-			perror("Error allocation entry for full command");
-			goto clean_entry;
-		}
-
 
-		// TODO change go kmalloc
-		full_buf = malloc(queue_size + node->entry->size);
-		if (!full_buf){
-			perror("Error allocate full command buffer");
-			goto clean_full_cmd;
-		}
-		full_cmd->size = queue_size + node->entry->size;
-		memset(full_buf, 0, full_cmd->size);
+	// TODO copy_from_user
+	pos = stage + stage_size;
+	memcpy(pos, ubuf, count);
 
-		packet = 1;
+	end = stage_size + count;
+	if (!memchr(pos, '\n', count)){
+		stage_size = end;
+		return count;
 	}
 
-	// in case of full packet last part will be added only if all allocation succeeded
-	// caller gets the error and has ability resend (retry) last part and fulfill command
-	// TODO lock packet
-	if (STAILQ_EMPTY(&queue)){
-		STAILQ_NEXT(node, next) = NULL;
-		STAILQ_INSERT_HEAD(&queue,node, next);
+	// TODO lock circular buffer
+	if (memchr(stage, '\n', end) == stage + end - 1){
+		// single command, staging buffer is handed to circular buffer as is
+		commit(stage, end);
+		stage = NULL;
+		stage_cap = 0;
+		start = end;
 	}
-	else
-		STAILQ_INSERT_TAIL(&queue, node, next);
-
-	// collect full size of packet
-	queue_size += node->entry->size;
-
-	// TODO unlock packet
-
-	// here should be all allocation success. Add command to circular buffer
-	if (packet){
-		// TODO lock packet
-		pos = full_buf;
-		while(!STAILQ_EMPTY(&queue)){
-			node = STAILQ_FIRST(&queue);
-			STAILQ_REMOVE_HEAD(&queue, next);
-
-			if(memcpy(pos, node->entry->buffptr, node->entry->size) == NULL){
-				perror("Error copy to full command buffer");
-				retval= -2; //
+	else{
+		// every command gets buffer of its size, staging buffer keeps unterminated tail
+		while ((nl = memchr(stage + start, '\n', end - start))){
+			size = nl - (stage + start) + 1;
+			if (!(cmd = malloc(size))){
+				perror("Error allocate command");
+				break;
 			}
-			pos += node->entry->size;
-			free((void *)(node->entry->buffptr));
-			free(node->entry);
-			free(node);
-			node = NULL;
-		}
-
-		queue_size = 0; //queue_size is part of packet(queue). Access must be locked
-		pos = NULL;
-		// TODO unlock packet
-
-
-		// TODO lock circular buffer
-
-		// We need free memory from first command in buffer
-		if (circ_buf->full)
-			del_buf = (void *)(aesd_circular_buffer_find_entry_offset_for_fpos(circ_buf, 0, NULL) ->buffptr);
-
-		full_cmd->buffptr = full_buf;
-		aesd_circular_buffer_add_entry(circ_buf, full_cmd);
-
-		// data from full_cmd copied to circular buf
-		// here free full_cmd
-		free(full_cmd);
-		full_cmd=NULL;
-
-		// here full_cmd data already replaced in circular buffer entry. But we stored in del_buf pointer to old command
-		if(del_buf){ //here del_cmd NULL or saved entry
-			free(del_buf);
-			del_buf=NULL;
+			memcpy(cmd, stage + start, size);
+			commit(cmd, size);
+			start += size;
 		}
-		// TODO unlock circular buffer
-		packet = 0;
 	}
+	// TODO unlock circular buffer
+
+	if (!start)
+		return -1;
+	if (nl){
+		// not accepted data after error
+		count = start - stage_size;
+		stage_size = 0;
+		return count;
+	}
+	if (stage)
+		memmove(stage, stage + start, end - start);
+	stage_size = end - start;
+	// TODO unlock stage
 
-	return retval;
-
-	// Cleanup in case of errors
-	clean_full_buffptr: free(full_buf);
-	clean_full_cmd: free(full_cmd);
-	clean_entry: free(node->entry);
-	clean_node:	free(node);
-	clean_buf: free(buf);
-
-	ret: return retval;
+	return count;
 }
 
 /***************************************************************
@@ -205,30 +115,28 @@ ssize_t aesd_read(char *ubuf, size_t count, size_t *f_pos)
     aesd_buffer_entry_t *entry;
     size_t offs_entry; //for avoiding "transfer" pointer and calculations
     size_t offs_full=*f_pos;
+    size_t copied = 0, chunk;
 
 //	if (mutex_lock_interruptible(&dev->circ_buf_lock))
 //		return -ERESTARTSYS;
-	entry = aesd_circular_buffer_find_entry_offset_for_fpos(circ_buf, offs_full, &offs_entry);
-	if (!entry){ //Entry not found
-		retval=0;
-		goto out;
-	}
-
-	/* Calculate size to return. Return no more than one command (till end entry buffer)*/
-	if ((entry->size - offs_entry) < count)
-		count = entry->size - offs_entry;
 
-
-	// TODO copy_to_user
-	if (memcpy(ubuf,  entry->buffptr + offs_entry, count) == NULL){
-		perror("Error copy data to user");
-		retval = -1;
+	/* Fill user buffer across commands */
+	entry = aesd_circular_buffer_find_entry_offset_for_fpos(circ_buf, offs_full, &offs_entry);
+	while (entry && copied < count){
+		chunk = entry->size - offs_entry;
+		if (chunk > count - copied)
+			chunk = count - copied;
+		// TODO copy_to_user
+		memcpy(ubuf + copied, entry->buffptr + offs_entry, chunk);
+		copied += chunk;
+		offs_full += chunk;
+		entry = aesd_circular_buffer_find_entry_offset_for_fpos(circ_buf, offs_full, &offs_entry);
 	}
-	*f_pos += count;
-	retval = count;
+	*f_pos = offs_full;
+	retval = copied;
 
-	//out: mutex_unlock(&dev->cicr_buf_lock);
-	out: return retval;
+	//mutex_unlock(&dev->cicr_buf_lock);
+	return retval;
 }
 
 
@@ -245,11 +153,11 @@ void print_buf(const aesd_circular_buffer_t *buf){
 	printf("Print full buffer\n");
 	AESD_CIRCULAR_BUFFER_FOREACH(entry,buf,i){
 		if (buf->in_offs == i)
-			printf("\033[31m%s\033[0m|", entry->buffptr);
+			printf("\033[31m%.*s\033[0m|", (int)entry->size, entry->buffptr);
 		else if (buf->out_offs == i)
-				printf("\033[32m%s\033[0m|", entry->buffptr);
+				printf("\033[32m%.*s\033[0m|", (int)entry->size, entry->buffptr);
 			else
-				printf("%s|", entry->buffptr);
+				printf("%.*s|", (int)entry->size, entry->buffptr);
 
 	}
 	printf("\n");
@@ -291,11 +199,11 @@ void test_get_entry(aesd_circular_buffer_t *buf){
 	while ((entry = aesd_circular_buffer_find_entry_offset_for_fpos(buf, offs_pos, &offs_byte))){
 		AESD_CIRCULAR_BUFFER_FOREACH(entry_print,buf,i){
 		if (buf->in_offs == i)
-			printf("\033[31m%s\033[0m", entry_print->buffptr);
+			printf("\033[31m%.*s\033[0m", (int)entry_print->size, entry_print->buffptr);
 		else if ( entry == entry_print)
-			printf("\033[32m%s\033[0m", entry_print->buffptr);
+			printf("\033[32m%.*s\033[0m", (int)entry_print->size, entry_print->buffptr);
 		else
-			printf("%s", entry_print->buffptr);
+			printf("%.*s", (int)entry_print->size, entry_print->buffptr);
 		}
 		printf("\n");
 
@@ -352,7 +260,10 @@ int main(int argc, char *argv[]){
 
 
 	aesd_circular_buffer_t *buf=malloc(sizeof(aesd_circular_buffer_t));
-	aesd_circular_buffer_init(buf);
+	if (!buf || aesd_circular_buffer_alloc(buf, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)){
+		perror("Error allocate circular buffer");
+		return 1;
+	}
 
 	for (i=0; i < write_count; i++)
 		for (j=0; j < entry_count; j++ )
@@ -366,7 +277,7 @@ int main(int argc, char *argv[]){
 	printf("Test Macro GET_ENTRY\n");
 	for (uint8_t cur=0; cur < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * 2; cur++){
 		entry = AESD_CIRCULAR_BUFFER_GET_ENTRY(buf,cur);
-		if(entry) printf("%s|",entry->buffptr);
+		if(entry) printf("%.*s|", (int)entry->size, entry->buffptr);
 	}
 	printf("\n");
 
@@ -381,10 +292,11 @@ int main(int argc, char *argv[]){
 
 
 
-	qentry_node_t *node;
-
 	circ_buf=malloc(sizeof(aesd_circular_buffer_t));
-	aesd_circular_buffer_init(circ_buf);
+	if (!circ_buf || aesd_circular_buffer_alloc(circ_buf, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)){
+		perror("Error allocate circular buffer");
+		return 1;
+	}
 
 	if (circ_buf->full)
 	 	printf("!!!!!!!!!!!Full Just after init\n");
@@ -411,6 +323,10 @@ int main(int argc, char *argv[]){
 	aesd_write("\n ", 2, &wr_size);
 	aesd_write("write12\n", 8, &wr_size);
 	print_buf(circ_buf);
+	// several commands by one write, the tail waits for newline
+	aesd_write("write13\nwrite14\nwr", 18, &wr_size);
+	aesd_write("ite15\n", 6, &wr_size);
+	print_buf(circ_buf);
 
 	printf("\n\n==================================\n");
 	printf("||Test read from circular buffer||\n");
@@ -436,10 +352,71 @@ int main(int argc, char *argv[]){
 	}
 	// clean all pointers to avoid access
 	aesd_circular_buffer_init(circ_buf);
+	free(stage);
 
 	print_buf(circ_buf);
 
 	read_buf(1024,0);
 
+	printf("\n===Test remove oldest entry (byte budget eviction)===\n");
+
+	aesd_circular_buffer_t small;
+	aesd_buffer_entry_t removed;
+	if (aesd_circular_buffer_alloc(&small, 3)){
+		perror("Error allocate circular buffer");
+		return 1;
+	}
+	for (j=0; j < 5; j++)
+		aesd_circular_buffer_add_entry(&small, &entry_set[j]);
+	print_buf(&small);
+	// capacity 3 keeps the last three entries in storage of 4
+	while (aesd_circular_buffer_remove_entry(&small, &removed))
+		printf("removed %.*s, %u left\n", (int)removed.size, removed.buffptr, small.count);
+	if (small.count || small.full || aesd_circular_buffer_find_entry_offset_for_fpos(&small, 0, NULL) ||
+	    aesd_circular_buffer_start(&small) != small.end)
+		printf("!!!!!!!!!!!Not empty after remove\n");
+	aesd_circular_buffer_free(&small);
+
+	printf("\n===End Test===\n");
+
+	printf("\n===Test prefix sum lookup against linear walk===\n");
+
+	size_t offs_byte, offs_linear, pos, k;
+	uint32_t cur;
+	int errors = 0;
+	if (aesd_circular_buffer_alloc(&small, 7)){
+		perror("Error allocate circular buffer");
+		return 1;
+	}
+	// zero sized entries and wrap of storage (8 slots)
+	for (k=0; k < 40; k++){
+		aesd_circular_buffer_add_entry(&small, &entry_set[(k * 5) % 6]);
+		// stream position of the oldest entry follows evictions
+		if (aesd_circular_buffer_start(&small) + aesd_circular_buffer_size(&small) != small.end)
+			errors++;
+		for (pos=0; pos <= aesd_circular_buffer_size(&small); pos++){
+			entry = aesd_circular_buffer_find_entry_offset_for_fpos(&small, pos, &offs_byte);
+			aesd_buffer_entry_t *linear = NULL;
+			for (cur=0, offs_linear=pos; cur < small.count; cur++){
+				if (AESD_CIRCULAR_BUFFER_GET_ENTRY(&small, cur)->size > offs_linear){
+					linear = AESD_CIRCULAR_BUFFER_GET_ENTRY(&small, cur);
+					break;
+				}
+				offs_linear -= AESD_CIRCULAR_BUFFER_GET_ENTRY(&small, cur)->size;
+			}
+			if (entry != linear || (entry && offs_byte != offs_linear))
+				errors++;
+		}
+	}
+	printf("%d errors\n", errors);
+	aesd_circular_buffer_free(&small);
+
+	printf("\n===End Test===\n");
+
+	aesd_circular_buffer_free(circ_buf);
+	aesd_circular_buffer_free(buf);
+	free(circ_buf);
+	free(buf);
+
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,77 @@
+#define FILENAME "/dev/aesdchar"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "aesd_mmap.h"
+
+/* Print commands stored in driver without read(), driver loaded with mmap_kb parameter */
+int main(int argc, char* argv[]){
+	struct aesd_mmap_hdr *hdr;
+	struct aesd_mmap_slot *slot;
+	char *data, *out = NULL;
+	size_t map_size, size;
+	uint64_t first, next, i;
+	uint32_t seq;
+
+	int fd = open(FILENAME, O_RDONLY);
+	if (fd < 0){
+		perror(FILENAME);
+		return 1;
+	}
+
+	// header tells size of the whole mapping
+	hdr = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED){
+		perror("mmap");
+		return 1;
+	}
+	if (hdr->magic != AESD_MMAP_MAGIC){
+		printf("wrong magic %x\n", hdr->magic);
+		return 1;
+	}
+	map_size = hdr->hdr_size + hdr->data_size;
+	munmap(hdr, sysconf(_SC_PAGESIZE));
+	hdr = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED){
+		perror("mmap");
+		return 1;
+	}
+	data = (char *)hdr + hdr->hdr_size;
+	printf("%u slots, data area %llu bytes\n", hdr->slots, (unsigned long long)hdr->data_size);
+
+	// commands are copied out, writer may reuse data area meanwhile
+	do {
+		while ((seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		next = hdr->next;
+		first = next - hdr->count;
+		size = hdr->size;
+		free(out);
+		out = malloc(size + 1);
+		size = 0;
+		for (i = first; out && i < next; i++){
+			slot = &hdr->slot[i & (hdr->slots - 1)];
+			// torn slot is dropped, seq check reads it again
+			if (size + slot->size > hdr->size ||
+			    slot->pos % hdr->data_size + slot->size > hdr->data_size)
+				break;
+			memcpy(out + size, data + slot->pos % hdr->data_size, slot->size);
+			size += slot->size;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) != seq);
+
+	printf("commands %llu..%llu, %zu bytes\n", (unsigned long long)first, (unsigned long long)next, size);
+	if (out)
+		fwrite(out, 1, size, stdout);
+
+	free(out);
+	munmap(hdr, map_size);
+	close(fd);
+	return 0;
+}
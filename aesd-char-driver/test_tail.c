@@ -0,0 +1,44 @@
+#define FILENAME "/dev/aesdchar"
+#define BUF_SIZE 1024
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+
+#include "aesd_ioctl.h"
+
+/* Print stored commands and then new ones as they are written, like tail -f. "-n" starts at the end */
+int main(int argc, char* argv[]){
+	char buf[BUF_SIZE];
+	uint32_t tail = 1;
+	ssize_t n;
+
+	int fd = open(FILENAME, O_RDONLY | O_NONBLOCK);
+	if (fd < 0){
+		perror(FILENAME);
+		return 1;
+	}
+	if (argc > 1 && strcmp(argv[1], "-n") == 0)
+		lseek(fd, 0, SEEK_END);
+	if (ioctl(fd, AESDCHAR_IOCTAIL, &tail)){
+		perror("ioctl");
+		return 1;
+	}
+
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	while (poll(&pfd, 1, -1) > 0){
+		// read returns EAGAIN when data is over
+		while ((n = read(fd, buf, BUF_SIZE)) > 0)
+			fwrite(buf, 1, n, stdout);
+		fflush(stdout);
+		if (n == 0 || errno != EAGAIN)
+			break;
+	}
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,335 @@
+/*
+ * Replay of aesdsocket capture (-c option) against a server.
+ * Every captured connection is replayed by own thread with the same
+ * receive chunks. Chunks are sent at captured times scaled by speed,
+ * speed 0 sends them as fast as possible.
+ *
+ * Packet ends with chunk ending with newline. Latency of packet is time
+ * from its end to the first byte of response and to the last byte of it,
+ * response ends when connection is idle for idle_ms.
+ *
+ * Usage: ./aesdreplay [-h host] [-p port] [-x speed] [-i idle_ms] capture_file
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "./capture.h"
+
+#define REPLAY_PORT "9000"
+#define REPLAY_IDLE_MS 2
+#define REPLAY_TIMEOUT_MS 5000
+#define REPLAY_BUF_SIZE 65536
+#define REPLAY_CHANNEL_HDR "AESDSOCKET_CHANNEL:"
+
+typedef struct event_s event_t;
+struct event_s{
+    uint64_t time;
+    uint16_t type;
+    uint32_t size;
+    char *data;
+};
+
+typedef struct conn_s conn_t;
+struct conn_s{
+    pthread_t thr;
+    event_t *ev;
+    size_t nev, cap;
+    double *first, *last;   /* latencies of packets, s */
+    size_t npkt;
+    uint64_t sent, received;
+    long timeouts;
+    int err;
+};
+
+static const char *host = "localhost";
+static const char *port = REPLAY_PORT;
+static double speed = 1.0;
+static int idle_ms = REPLAY_IDLE_MS;
+static struct addrinfo *addr = NULL;
+static double replay_start;
+
+static double now_s(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*****************************************************
+*
+* Capture file
+*
+*****************************************************/
+
+static int load_capture(const char *path, conn_t **conns, size_t *nconns){
+    capture_hdr_t hdr;
+    capture_rec_t rec;
+    conn_t *conn, *new_conns;
+    event_t *ev;
+    uint32_t id;
+    FILE *f;
+    int retval = -1;
+
+    if ((f = fopen(path, "r")) == NULL){
+        perror(path);
+        return -1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic))){
+        fprintf(stderr, "%s: not a capture file\n", path);
+        goto out;
+    }
+    while (fread(&rec, sizeof(rec), 1, f) == 1){
+        // connection ids go from 1 without gaps
+        id = le32toh(rec.conn);
+        if (id == 0)
+            continue;
+        if (id > *nconns){
+            if ((new_conns = realloc(*conns, id * sizeof(conn_t))) == NULL)
+                goto out;
+            memset(new_conns + *nconns, 0, (id - *nconns) * sizeof(conn_t));
+            *conns = new_conns;
+            *nconns = id;
+        }
+        conn = &(*conns)[id - 1];
+        if (conn->nev == conn->cap){
+            conn->cap = conn->cap ? conn->cap * 2 : 16;
+            if ((ev = realloc(conn->ev, conn->cap * sizeof(event_t))) == NULL)
+                goto out;
+            conn->ev = ev;
+        }
+        ev = &conn->ev[conn->nev++];
+        ev->time = le64toh(rec.time);
+        ev->type = le16toh(rec.type);
+        ev->size = le32toh(rec.size);
+        ev->data = NULL;
+        if (ev->size && ((ev->data = malloc(ev->size)) == NULL || fread(ev->data, ev->size, 1, f) != 1)){
+            // torn tail of capture of crashed server
+            conn->nev--;
+            free(ev->data);
+            break;
+        }
+    }
+    retval = 0;
+
+    out: fclose(f);
+    return retval;
+}
+
+/*****************************************************
+*
+* Replay
+*
+*****************************************************/
+
+static void sleep_until(double deadline){
+    double left = deadline - now_s();
+    struct timespec ts;
+
+    if (left <= 0)
+        return;
+    ts.tv_sec = (time_t)left;
+    ts.tv_nsec = (long)((left - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+/*!
+ * Read and drop data until deadline (s), EOF or error
+ * @return 1 on EOF, -1 on error, 0 otherwise
+ */
+static int drain_until(conn_t *conn, int fd, double deadline){
+    char buf[REPLAY_BUF_SIZE];
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    double left;
+    ssize_t n;
+
+    while ((left = deadline - now_s()) > 0){
+        if (poll(&pfd, 1, (int)(left * 1000) + 1) <= 0)
+            return 0;
+        if ((n = recv(fd, buf, sizeof(buf), 0)) <= 0)
+            return n ? -1 : 1;
+        conn->received += n;
+    }
+    return 0;
+}
+
+/*!
+ * Read response of packet sent at start and store its latency
+ * @return 0 on success
+ */
+static int read_response(conn_t *conn, int fd, double start){
+    char buf[REPLAY_BUF_SIZE];
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    double first = 0, last = 0;
+    int timeout = REPLAY_TIMEOUT_MS;
+    ssize_t n;
+
+    // response has no length, it ends when connection is idle
+    while (poll(&pfd, 1, timeout) > 0){
+        if ((n = recv(fd, buf, sizeof(buf), 0)) < 0)
+            return -1;
+        if (n == 0)
+            break;
+        conn->received += n;
+        last = now_s();
+        if (first == 0)
+            first = last;
+        timeout = idle_ms;
+    }
+    if (first == 0){
+        fprintf(stderr, "No response in %d ms\n", REPLAY_TIMEOUT_MS);
+        conn->timeouts++;
+        return 0;
+    }
+    conn->first[conn->npkt] = first - start;
+    conn->last[conn->npkt++] = last - start;
+    return 0;
+}
+
+static void *replay_conn(void *arg){
+    conn_t *conn = arg;
+    event_t *ev;
+    double deadline;
+    ssize_t n;
+    size_t done;
+    uint64_t conn_sent = 0;     // bytes sent in current connection
+    int fd = -1, hdr;
+
+    if ((conn->first = malloc(conn->nev * sizeof(double))) == NULL ||
+        (conn->last = malloc(conn->nev * sizeof(double))) == NULL)
+        goto err;
+    for (size_t i = 0; i < conn->nev; i++){
+        ev = &conn->ev[i];
+        // responses are read while waiting for the next chunk
+        deadline = speed > 0 ? replay_start + ev->time / 1e9 / speed : 0;
+        if (fd < 0)
+            sleep_until(deadline);
+        else if (drain_until(conn, fd, deadline) < 0)
+            goto err;
+
+        switch (ev->type){
+        case CAPTURE_OPEN:
+            if ((fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) == -1 ||
+                connect(fd, addr->ai_addr, addr->ai_addrlen) == -1)
+                goto err;
+            conn_sent = 0;
+            break;
+        case CAPTURE_DATA:
+            if (fd < 0 || ev->size == 0)
+                break;
+            // channel header alone has no response
+            hdr = conn_sent == 0 && ev->size > sizeof(REPLAY_CHANNEL_HDR) - 1 &&
+                  memcmp(ev->data, REPLAY_CHANNEL_HDR, sizeof(REPLAY_CHANNEL_HDR) - 1) == 0 &&
+                  memchr(ev->data, '\n', ev->size) == ev->data + ev->size - 1;
+            for (done = 0; done < ev->size; done += n)
+                if ((n = send(fd, ev->data + done, ev->size - done, MSG_NOSIGNAL)) <= 0)
+                    goto err;
+            conn->sent += ev->size;
+            conn_sent += ev->size;
+            // end of packet, server responds after commit
+            if (!hdr && ev->data[ev->size - 1] == '\n' && read_response(conn, fd, now_s()))
+                goto err;
+            break;
+        case CAPTURE_CLOSE:
+            if (fd >= 0){
+                shutdown(fd, SHUT_WR);
+                drain_until(conn, fd, now_s() + REPLAY_TIMEOUT_MS / 1000.0);
+                close(fd);
+                fd = -1;
+            }
+            break;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+
+    err: fprintf(stderr, "Connection error: %s\n", strerror(errno));
+    conn->err = 1;
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+static void print_lat(const char *name, double *lat, size_t n){
+    qsort(lat, n, sizeof(double), cmp_double);
+    printf("%-8s %10.1f %10.1f %10.1f %10.1f\n", name,
+           lat[n / 2] * 1e6, lat[n * 90 / 100] * 1e6, lat[n * 99 / 100] * 1e6, lat[n - 1] * 1e6);
+}
+
+int main(int argc, char *argv[]){
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    conn_t *conns = NULL;
+    size_t nconns = 0, npkt = 0, i, j;
+    uint64_t sent = 0, received = 0;
+    long errors = 0, timeouts = 0;
+    double *first, *last, total;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "h:p:x:i:")) != -1){
+        switch (opt){
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'x': speed = atof(optarg); break;
+        case 'i': idle_ms = atoi(optarg); break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1 || speed < 0 || idle_ms <= 0){
+        usage: fprintf(stderr, "Usage: %s [-h host] [-p port] [-x speed, 0 - max] [-i idle_ms]"
+                " capture_file\n", argv[0]);
+        return 1;
+    }
+    if ((ret = getaddrinfo(host, port, &hints, &addr)) != 0){
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(ret));
+        return 1;
+    }
+    if (load_capture(argv[optind], &conns, &nconns))
+        return 1;
+
+    replay_start = now_s();
+    for (i = 0; i < nconns; i++)
+        if (pthread_create(&conns[i].thr, NULL, replay_conn, &conns[i])){
+            perror("pthread_create");
+            return 1;
+        }
+    for (i = 0; i < nconns; i++){
+        pthread_join(conns[i].thr, NULL);
+        npkt += conns[i].npkt;
+        sent += conns[i].sent;
+        received += conns[i].received;
+        errors += conns[i].err;
+        timeouts += conns[i].timeouts;
+    }
+    total = now_s() - replay_start;
+
+    printf("%zu connections, %zu packets, %llu bytes sent, %llu received in %.3f s, speed %g\n",
+           nconns, npkt, (unsigned long long)sent, (unsigned long long)received, total, speed);
+    printf("%ld connection errors, %ld responses timed out\n", errors, timeouts);
+    if (npkt == 0)
+        return errors ? 1 : 0;
+    if ((first = malloc(npkt * sizeof(double))) == NULL || (last = malloc(npkt * sizeof(double))) == NULL)
+        return 1;
+    for (i = 0, npkt = 0; i < nconns; i++)
+        for (j = 0; j < conns[i].npkt; j++, npkt++){
+            first[npkt] = conns[i].first[j];
+            last[npkt] = conns[i].last[j];
+        }
+    printf("%-8s %10s %10s %10s %10s\n", "latency", "p50 us", "p90 us", "p99 us", "max us");
+    print_lat("first", first, npkt);
+    print_lat("last", last, npkt);
+    return errors ? 1 : 0;
+}
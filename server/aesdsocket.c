@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,39 +10,55 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <time.h>
+#include <errno.h>
+#include <poll.h>
 #include <pthread.h>
+#include <limits.h>
+#include <sys/signalfd.h>
 #include "./queue.h"
+#include "./channel.h"
+#include "./repl.h"
+#include "./metrics.h"
+#include "./capture.h"
 #include "../aesd-char-driver/aesd_ioctl.h"
 
 #define PORT 9000
-#define MAX_CLIENTS 5
+#define LISTEN_BACKLOG SOMAXCONN
+#define ACCEPT_BATCH 64
+#define ACCEPT_BACKOFF_MS 100   // listen socket is not polled when descriptors are exhausted
+#define STACK_MIN_KB 32     // packet path with syslog overflows 16 kB
 #define BUF_SIZE 1024
 #define FILENAME "/dev/aesdchar"
 #define KEEPALIVE 10
+#define DRAIN_MS 5000
 
 #define AESDCHAR_IOCSEEKTO_CMD "AESDCHAR_IOCSEEKTO:"
 #define AESDCHAR_IOCSEEKTO_CMD_SIZE sizeof(AESDCHAR_IOCSEEKTO_CMD)/sizeof(char)-1
 
 static volatile int running = 1;
-static volatile int wait_connection = 0;
-static volatile int file_fd = -1, server_fd = -1;
+static volatile int server_fd = -1;
+static int draining = 0;
+static int log_debug = 1;   // debug messages pass syslog mask
+static int reserve_fd = -1;     // freed to accept and close connection when descriptors are exhausted
+static int fds_exhausted = 0;   // logged once until accept succeeds again
+static pthread_attr_t *client_attr = NULL;  // stack of client threads, NULL - default
 sigset_t block_set;
-pthread_mutex_t lock;
+sigset_t stop_set;      // delivered to main loop by signalfd
+
+// client_fd of threads is closed and shut down under this lock
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
 
 typedef struct client_thr_s client_thr_t;
 struct client_thr_s{
     pthread_t thr_id;
     int client_fd;
     int state;
+    int busy;       // packet in progress
+    struct sockaddr_in addr;    // peer, formatted by thread for debug log only
+    SLIST_ENTRY(client_thr_s) next;
 };
 
-typedef struct clt_lst_s clt_lst_t;
-struct clt_lst_s{
-    client_thr_t *clt;
-    SLIST_ENTRY(clt_lst_s) next;
-};
-
-SLIST_HEAD(slisthead, clt_lst_s) head;
+SLIST_HEAD(slisthead, client_thr_s) head;
 
 /*****************************************************
 *
@@ -103,41 +120,118 @@ int make_cmd(char *cmd_buf, size_t cmd_length, struct aesd_seekto *seekto){
     return 0;
 }
 
+/*!
+ * Receive optional channel header from the beginning of connection.
+ * @param client_fd socket
+ * @param buffer buffer of BUF_SIZE for received data
+ * @param left number of bytes in buffer after header. They are first data of packet.
+ * @param cap_id capture id of connection
+ * @return selected channel or NULL in case of error, closed connection or wrong name
+ */
+channel_t *recv_channel(int client_fd, char *buffer, size_t *left, uint32_t cap_id){
+    char name[CHANNEL_NAME_MAX + 1];
+    size_t have = 0, cmp_size, name_size;
+    ssize_t bytes_read;
+    char *end;
+
+    *left = 0;
+    while ((bytes_read = recv(client_fd, buffer + have, BUF_SIZE - have, 0)) > 0){
+        capture_data(cap_id, buffer + have, bytes_read);
+        have += bytes_read;
+
+        // no header, all received bytes are data of default channel
+        cmp_size = have < CHANNEL_HDR_SIZE ? have : CHANNEL_HDR_SIZE;
+        if (memcmp(buffer, CHANNEL_HDR, cmp_size)){
+            *left = have;
+            return channel_default();
+        }
+        if (have < CHANNEL_HDR_SIZE)
+            continue;
+
+        end = memchr(buffer + CHANNEL_HDR_SIZE, '\n', have - CHANNEL_HDR_SIZE);
+        name_size = end ? (size_t)(end - buffer) - CHANNEL_HDR_SIZE : have - CHANNEL_HDR_SIZE;
+        if (name_size > CHANNEL_NAME_MAX){
+            syslog(LOG_ERR, "%s", "Channel name too long");
+            return NULL;
+        }
+        if (!end)
+            continue;
+
+        memcpy(name, buffer + CHANNEL_HDR_SIZE, name_size);
+        name[name_size] = '\0';
+        syslog(LOG_DEBUG, "Channel header %s", name);
+
+        *left = have - (end - buffer + 1);
+        memmove(buffer, end + 1, *left);
+        return channel_get(name);
+    }
+
+    if (bytes_read == -1)
+        syslog(LOG_ERR, "%s: %m", "Error recv");
+    return NULL;
+}
+
 
 void cleanup_threads(void){
 
-    clt_lst_t *node=NULL;
-    clt_lst_t *tnode=NULL;
+    client_thr_t *clt=NULL;
+    client_thr_t *tclt=NULL;
 
-    SLIST_FOREACH_SAFE(node, &head, next, tnode) {
-        if(node == NULL)
-            break;
-        if (node->clt->state == 1){
-            if (pthread_join(node -> clt -> thr_id, NULL) != 0)
+    SLIST_FOREACH_SAFE(clt, &head, next, tclt) {
+        if (__atomic_load_n(&clt->state, __ATOMIC_ACQUIRE) == 1){
+            if (pthread_join(clt -> thr_id, NULL) != 0)
                 syslog(LOG_ERR, "%s: %m", "Error join thread");
 
-            SLIST_REMOVE(&head, node, clt_lst_s, next);
-            free(node -> clt);
-            free(node);
+            SLIST_REMOVE(&head, clt, client_thr_s, next);
+            free(clt);
         }
     }
 
 }
 
-void exit_norm(void){
-    // wait for ending threads
-    while (!SLIST_EMPTY(&head))
-        cleanup_threads();
+static long elapsed_ms(const struct timespec *start){
+    struct timespec now;
 
-    if (close(server_fd) == -1)
-        syslog(LOG_ERR, "%s: %m", "Close server descriptor");
-
-//    if (fsync(file_fd) < 0)
-//        syslog(LOG_ERR, "%s: %m", "Error sync to disk before close");
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
 
+/*!
+ * Stop accepting and wait for connections. Idle connections are closed at
+ * once, packets in progress get drain_ms to finish, then all are closed.
+ */
+void drain_connections(unsigned drain_ms){
+    struct timespec start, pause = {0, 10 * 1000000L};
+    client_thr_t *clt = NULL;
+    int forced = 0, force;
 
+    if (close(server_fd) == -1)
+        syslog(LOG_ERR, "%s: %m", "Close server descriptor");
+    server_fd = -1;
+    __atomic_store_n(&draining, 1, __ATOMIC_SEQ_CST);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (cleanup_threads(), !SLIST_EMPTY(&head)){
+        force = elapsed_ms(&start) >= drain_ms;
+        // recv of idle thread returns 0, thread exits as closed by client
+        pthread_mutex_lock(&clients_lock);
+        SLIST_FOREACH(clt, &head, next)
+            if (clt->client_fd >= 0 && (force || !__atomic_load_n(&clt->busy, __ATOMIC_SEQ_CST))){
+                shutdown(clt->client_fd, force ? SHUT_RDWR : SHUT_RD);
+                forced += force;
+            }
+        pthread_mutex_unlock(&clients_lock);
+        nanosleep(&pause, NULL);
+    }
+    syslog(LOG_INFO, "Connections drained in %ld ms, %d forced", elapsed_ms(&start), forced);
+}
 
-    pthread_mutex_destroy(&lock);
+void exit_norm(unsigned drain_ms){
+    drain_connections(drain_ms);
+    // follower applies records to channels until it is stopped
+    repl_stop();
+    channels_destroy();
+    capture_close();
     exit(EXIT_SUCCESS);
 }
 
@@ -147,14 +241,16 @@ void exit_norm(void){
 *
 *****************************************************/
 
-void exit_handler(int sig)
-{
-    running = 0;
-    syslog(LOG_DEBUG,"%s", "Caught signal, exiting");
-    if (wait_connection){
-        exit_norm();
-    }
+/*!
+ * Read stop signal from signalfd in main loop
+ */
+void handle_signal(int sig_fd){
+    struct signalfd_siginfo si;
 
+    if (read(sig_fd, &si, sizeof(si)) != sizeof(si))
+        return;
+    syslog(LOG_DEBUG, "Caught signal %u, exiting", si.ssi_signo);
+    running = 0;
 }
 
 void timer_handler(int sig){
@@ -170,10 +266,12 @@ void timer_handler(int sig){
     strftime(time_str, sizeof(time_str), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", time_info);
     syslog(LOG_DEBUG,"%s",time_str);
     /* write to file */
-    // pthread_mutex_lock(&lock); is unnecessary here. write is signal and thread safe due to POSIX.
+    // channel lock is unnecessary here. write is signal and thread safe due to POSIX.
     // and SIGALRM is blocked during packet processing
     // TODO check error and partial write
-    write(file_fd, &time_str, strlen(time_str));
+    channel_t *ch = channel_default();
+    if (ch && ch->be && ch->be->fd >= 0)
+        backend_write(ch->be, time_str, strlen(time_str));
 }
 
 /*****************************************************
@@ -187,6 +285,15 @@ void *process_connection(void *thread_data){
     data ->thr_id = pthread_self();
 
     int client_fd = data -> client_fd;
+    char client_ip[INET_ADDRSTRLEN];
+
+    // Log connection details to syslog, address is formatted only if it is logged
+    if (log_debug){
+        if (!inet_ntop(AF_INET, &data->addr.sin_addr, client_ip, INET_ADDRSTRLEN))
+            syslog(LOG_ERR, "%s: %m", "Error convert address");
+        else
+            syslog(LOG_DEBUG, "Accepted connection from %s:%d", client_ip, ntohs(data->addr.sin_port));
+    }
 
     // prepare buffer
     char buffer[BUF_SIZE];
@@ -197,32 +304,54 @@ void *process_connection(void *thread_data){
     memset(&cmd_buf, 0, BUF_SIZE);
     struct aesd_seekto seekto;
     memset(&seekto, 0, sizeof(seekto));
+    struct aesd_seekto seek_req;    // last seek of packet, for response from cache
+    int have_seek = 0;
+    cache_snap_t *snap = NULL;
+    uint64_t resp_pos;
 
     sigset_t old_set;
     sigemptyset(&old_set);
 
     // Read data from the client connection
     int packet = 0;
+    int locked = 0;     // channel lock is held (write part of packet)
+    int pkt_err = 0;    // packet can't be kept, it is failed
     ssize_t bytes_read=0;
+    size_t left = 0;
+    pkt_buf_t pkt = {0};    // data of current packet for commit
+
+    // Select channel. Data received after header is start of first packet
+    uint32_t cap_id = capture_conn();
+    channel_t *ch = recv_channel(client_fd, buffer, &left, cap_id);
+    if (ch == NULL){
+        syslog(LOG_DEBUG,"%s", "No channel for connection");
+        goto clean_thread;
+    }
+    backend_t *be = ch->be;
+    int sharded = ch->slog != NULL;     // packets of channel don't take channel lock
+    // packet is received before channel lock, sharded channel has no lock and backend
+    int scheduled = ch->sched_ns != 0 && !sharded;
 
     // Exit from loop to label in case error or closed connection
     do{
-        while ( (bytes_read = recv(client_fd, buffer, BUF_SIZE, 0)) > 0) {
-            // Lock mutex, open file and block signals if new packet
+        while ( (bytes_read = left ? (ssize_t)left : recv(client_fd, buffer, BUF_SIZE, 0)) > 0) {
+            if (!left)
+                capture_data(cap_id, buffer, bytes_read);
+            left = 0;
+            // Lock channel, open backend and block signals if new packet
             if (!packet){
                 sigprocmask(SIG_BLOCK, &block_set, &old_set);
-                if (pthread_mutex_lock(&lock)){
-                    syslog(LOG_ERR, "%s: %m", "Failed to lock mutex");
-                    goto clean_thread;
-                }
-
+                __atomic_store_n(&data->busy, 1, __ATOMIC_SEQ_CST);
                 packet = 1;
                 cmd_size = 0;
-                // Open file for timestamps and data
-                file_fd = open(FILENAME, O_CREAT | O_RDWR | O_APPEND | O_TRUNC | O_SYNC, 0644);
-                if (file_fd < 0) {
-                    syslog(LOG_ERR, "%s: %m", "Failed to open data file");
-                    goto clean_thread;
+                have_seek = 0;
+                if (!sharded && !scheduled){
+                    if (channel_lock(ch, 0))
+                        goto clean_thread;
+                    locked = 1;
+                    // Prepare backend for timestamps and data
+                    if (backend_begin(be))
+                        goto clean_thread;
                 }
             }
 
@@ -234,8 +363,10 @@ void *process_connection(void *thread_data){
                 switch(make_cmd(cmd_buf, cmd_size,&seekto)){
                 case 0:{
                     syslog(LOG_DEBUG,"set circular buffer to command %d offset %d\n", seekto.write_cmd, seekto.write_cmd_offset);
-                    if (ioctl(file_fd, AESDCHAR_IOCSEEKTO, &seekto))
+                    if (locked && backend_seekto(be, seekto.write_cmd, seekto.write_cmd_offset))
                         syslog(LOG_ERR, "%s: %m", "ioctl error");
+                    seek_req = seekto;
+                    have_seek = 1;
                     memset(&cmd_buf, 0, BUF_SIZE);
                     cmd_size = 0;
                     memset(&seekto, 0, sizeof(seekto));
@@ -246,7 +377,13 @@ void *process_connection(void *thread_data){
                  }
             }
             else{
-                write(file_fd, &buffer, bytes_read);
+                // data not kept for cache and replication is not written to backend too
+                if (pkt_buf_append(&pkt, buffer, bytes_read)){
+                    pkt_err = 1;
+                    goto clean_thread;
+                }
+                if (locked)
+                    backend_write(be, buffer, bytes_read);
             }
 
 
@@ -276,9 +413,57 @@ void *process_connection(void *thread_data){
 
 
 
+        // scheduled packet waits for its turn by size, then it is written at once
+        if (scheduled){
+            if (channel_lock(ch, pkt.size))
+                goto clean_thread;
+            locked = 1;
+            if (backend_begin(be))
+                goto clean_thread;
+            if (channel_write(ch, pkt.data, pkt.size) < pkt.size)
+                goto clean_thread;
+            if (have_seek && backend_seekto(be, seek_req.write_cmd, seek_req.write_cmd_offset))
+                syslog(LOG_ERR, "%s: %m", "ioctl error");
+        }
+
+        // packet is written to backend, make it durable before response.
+        // Sharded log writes whole packet now and waits for older packets
+        int commit_err = sharded ? channel_append(ch, pkt.data, pkt.size) :
+                                   channel_commit(ch, pkt.data, pkt.size);
+        pkt.size = 0;
+        if (commit_err)
+            goto clean_thread;
+
+        // response from shared cache if it has data, backend is not read then
+        snap = channel_snapshot(ch);
+        int from_cache = cache_seek(snap, have_seek ? &seek_req.write_cmd : NULL,
+                                    seek_req.write_cmd_offset, &resp_pos) == 0;
+        if (!from_cache && sharded){
+            if (channel_send_log(ch, client_fd, have_seek ? &seek_req.write_cmd : NULL,
+                                 seek_req.write_cmd_offset)){
+                syslog(LOG_ERR, "%s: %m", "Fail send");
+                goto clean_thread;
+            }
+            from_cache = 1;
+            bytes_read = 0;
+        }
+        else if (from_cache){
+            // snapshot is immutable, next packets of channel don't wait for this send
+            if (locked){
+                backend_end(be);
+                channel_unlock(ch);
+                locked = 0;
+            }
+            if (cache_send(snap, client_fd, resp_pos) < 0){
+                syslog(LOG_ERR, "%s: %m", "Fail send");
+                goto clean_thread;
+            }
+            bytes_read = 0;
+        }
+
         int bytes_send;
         // read using current file_pos
-        while ((bytes_read = read(file_fd, &buffer, BUF_SIZE)) > 0){
+        while (!from_cache && (bytes_read = backend_read(be, buffer, BUF_SIZE)) > 0){
             // TODO check error and partial send
             if ((bytes_send = send(client_fd, &buffer, bytes_read, 0)) < bytes_read){
                 syslog(LOG_ERR, "%s: %m", "Fail send");
@@ -294,24 +479,42 @@ void *process_connection(void *thread_data){
             goto clean_thread;
         }
 
-        if (close(file_fd) == -1)
-            syslog(LOG_ERR, "%s: %m", "Close file");
+        if (locked){
+            backend_end(be);
+            channel_unlock(ch);
+            locked = 0;
+        }
+        cache_put(snap);
+        snap = NULL;
 
         memset(&buffer, 0, BUF_SIZE);
 
-
-        pthread_mutex_unlock(&lock);
         sigprocmask(SIG_SETMASK, &old_set, NULL);
         packet = 0;
+        __atomic_store_n(&data->busy, 0, __ATOMIC_SEQ_CST);
 
+        // server is stopping, packet is finished
+        if (__atomic_load_n(&draining, __ATOMIC_SEQ_CST))
+            goto clean_thread;
     }while(1);
 
 
     // unlock mutex and unblock signals
-    clean_thread: if (packet){
-        if(file_fd >=0)
-            lseek(file_fd, (off_t) 0, SEEK_SET); // try to seek to end of file here error check have no sense
-        pthread_mutex_unlock(&lock);
+    clean_thread: cache_put(snap);
+    // received part of scheduled packet is written like streamed one
+    if (scheduled && !pkt_err && pkt.size && !locked && channel_lock(ch, pkt.size) == 0){
+        locked = 1;
+        pkt.size = backend_begin(be) == 0 ? channel_write(ch, pkt.data, pkt.size) : 0;
+    }
+    if (locked){
+        // data written before disconnect is in backend already
+        channel_commit(ch, pkt.data, pkt.size);
+        backend_end(be);
+        channel_unlock(ch);
+        locked = 0;
+    }
+    if (packet){
+        // unterminated data of sharded channel is not appended
         sigprocmask(SIG_SETMASK, &old_set, NULL);
         packet=0;
 
@@ -319,74 +522,128 @@ void *process_connection(void *thread_data){
 
 
 
+    pkt_buf_free(&pkt);
+    capture_end(cap_id);
+
     // close client socket
+    pthread_mutex_lock(&clients_lock);
+    data->client_fd = -1;
+    pthread_mutex_unlock(&clients_lock);
     if (close(client_fd) == -1)
         syslog(LOG_ERR, "%s: %m", "Error Close socket descriptor");
 
     // mark thread as finished
-    data -> state = 1;
+    metric_add(metric_cached("connections"), -1);
+    __atomic_store_n(&data->state, 1, __ATOMIC_RELEASE);
 
     //pthread_exit(NULL);
     return NULL;
 }
 
-void accept_connection(void){
-
-    int client_fd = -1;
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    char client_ip[INET_ADDRSTRLEN];
-
-     /* Accept a new client connection */
+/*!
+ * Descriptors are exhausted: reserve descriptor is freed to accept and close
+ * one pending connection, so client is refused instead of waiting in backlog
+ * and listen socket doesn't stay readable.
+ * @return 0 on success, -1 if connection can't be closed or reserve can't be restored
+ */
+static int accept_shed(void){
+    int fd, retval = 0;
 
-    wait_connection = 1;
-    if ((client_fd = accept(server_fd, (struct sockaddr *)&client_addr, (socklen_t*)&addr_len)) < 0) {
-        syslog(LOG_ERR, "%s: %m", "Accept failed");
-        return;
+    if (!fds_exhausted){
+        syslog(LOG_ERR, "%s: %m", "Out of descriptors, pending connections are closed");
+        fds_exhausted = 1;
     }
-    wait_connection = 0;
-
-    // Log connection details to syslog
-    if (!inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN)){
-        syslog(LOG_ERR, "%s: %m", "Error convert address");
+    if (reserve_fd >= 0)
+        close(reserve_fd);
+    if ((fd = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0){
+        close(fd);
+        metric_add(metric_cached("connections_shed"), 1);
     }
-    else
-        syslog(LOG_DEBUG, "Accepted connection from %s:%d", client_ip,client_addr.sin_port);
-
-
-    /* Create new thread */
-    // Struct for data
-    client_thr_t *data=NULL;
-    data = malloc(sizeof(client_thr_t));
-    if (data == NULL){
-        syslog(LOG_ERR, "%s: %m", "Error allocate memory for thread data");
-        return;
-    }
-
-    data -> thr_id = 0;
-    data -> client_fd = client_fd;
-    data -> state = 0;
+    else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+        retval = -1;
+    if ((reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) == -1)
+        retval = -1;
+    return retval;
+}
 
-    // create node for storing thread in list
-    clt_lst_t *node=NULL;
-    node = malloc(sizeof(clt_lst_t));
-    if (node == NULL){
-        syslog(LOG_ERR, "%s: %m", "Error allocate memory for list node");
-        return;
+/*!
+ * Accept pending connections in batch and start their threads.
+ * Listen socket is nonblocking, batch ends when backlog is empty.
+ * @return 0, -1 if descriptors are exhausted and accept should back off
+ */
+int accept_connections(void){
+    client_thr_t *batch[ACCEPT_BATCH];
+    struct sockaddr_in client_addr;
+    socklen_t addr_len;
+    int client_fd, n = 0, retval = 0;
+
+    while (n < ACCEPT_BATCH){
+        addr_len = sizeof(client_addr);
+        if ((client_fd = accept4(server_fd, (struct sockaddr *)&client_addr, &addr_len, SOCK_CLOEXEC)) < 0){
+            if (errno == EMFILE || errno == ENFILE)
+                retval = accept_shed();
+            else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+                syslog(LOG_ERR, "%s: %m", "Accept failed");
+            break;
+        }
+        if (fds_exhausted){
+            syslog(LOG_INFO, "%s", "Descriptors available, connections are accepted");
+            fds_exhausted = 0;
+        }
+        // one allocation per client: thread data is list node too
+        if ((batch[n] = malloc(sizeof(client_thr_t))) == NULL){
+            syslog(LOG_ERR, "%s: %m", "Error allocate memory for thread data");
+            close(client_fd);
+            break;
+        }
+        batch[n]->thr_id = 0;
+        batch[n]->client_fd = client_fd;
+        batch[n]->state = 0;
+        batch[n]->busy = 0;
+        batch[n]->addr = client_addr;
+        n++;
     }
-    node -> clt = data;
-
-    // Create thread
-    pthread_t thread; // for storing thr_id
-
-    if (pthread_create( &thread, NULL, process_connection, (void*) data) !=0){
-        syslog(LOG_ERR, "%s: %m", "Error create new thread");
+    metric_add(metric_cached("connections_accepted"), n);
+
+    /* Create threads */
+    for (int i = 0; i < n; i++){
+        metric_add(metric_cached("connections"), 1);
+        if (pthread_create(&batch[i]->thr_id, client_attr, process_connection, batch[i]) != 0){
+            metric_add(metric_cached("connections"), -1);
+            syslog(LOG_ERR, "%s: %m", "Error create new thread");
+            close(batch[i]->client_fd);
+            free(batch[i]);
+            continue;
+        }
+        SLIST_INSERT_HEAD(&head, batch[i], next);
     }
 
-    /* add thread to list*/
+    /* join finished threads once per batch */
     cleanup_threads();
-    SLIST_INSERT_HEAD(&head, node, next);
+    return retval;
+}
 
+/*!
+ * Parse client thread stack "stack_kb[:guard_kb]" and prepare attributes
+ * @return 0 on success
+ */
+int parse_stack(const char *arg, pthread_attr_t *attr){
+    unsigned long stack_kb, guard_kb = 0;
+    int guard = 0;
+    char *end;
+
+    stack_kb = strtoul(arg, &end, 0);
+    if (*end == ':'){
+        guard = 1;
+        guard_kb = strtoul(end + 1, &end, 0);
+    }
+    if (*end != '\0' || stack_kb < STACK_MIN_KB || stack_kb * 1024 < PTHREAD_STACK_MIN)
+        return -1;
+    if (pthread_attr_init(attr) != 0 ||
+        pthread_attr_setstacksize(attr, stack_kb * 1024) != 0 ||
+        (guard && pthread_attr_setguardsize(attr, guard_kb * 1024) != 0))
+        return -1;
+    return 0;
 }
 
 /*****************************************************
@@ -399,11 +656,89 @@ int main(int argc, char * argv[]){
     openlog(NULL, 0, LOG_USER);
     syslog(LOG_DEBUG,"%s","STARTED");
 
-    // Create mutex
-    if (pthread_mutex_init(&lock, NULL) !=0){
-        syslog(LOG_ERR, "%s: %m", "Error initialize mutex");
+    /* Check cmd line arguments */
+    int daemon_mode = 0;
+    const char *data_path = FILENAME;
+    const char *channel_dir = CHANNEL_DIR;
+    const char *metrics_path = NULL;
+    const char *capture_path = NULL;
+    const char *primary_addr = NULL;
+    wal_opts_t wal_opts = WAL_OPTS_DEFAULT;
+    size_t cache_budget = CACHE_BUDGET;
+    uint64_t sched_ns = 0;
+    unsigned drain_ms = DRAIN_MS;
+    pthread_attr_t stack_attr;
+    int port = PORT, repl_port = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "dqD:f:p:R:F:m:s:S:K:C:P:c:j:g:t:")) != -1){
+        switch (opt){
+        case 'd': daemon_mode = 1; break;
+        case 'q': setlogmask(LOG_UPTO(LOG_INFO)); break;
+        case 'D': channel_dir = optarg; break;
+        case 'f': data_path = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'R': repl_port = atoi(optarg); break;
+        case 'F': primary_addr = optarg; break;
+        case 'm': metrics_path = optarg; break;
+        case 'c': capture_path = optarg; break;
+        case 'j': sched_ns = strtoull(optarg, NULL, 0); break;
+        case 'g': drain_ms = strtoul(optarg, NULL, 0); break;
+        case 'C': cache_budget = strtoul(optarg, NULL, 0); break;
+        case 's':
+            if (wal_parse_sync(optarg, &wal_opts) == 0)
+                break;
+            fprintf(stderr, "Wrong sync mode %s\n", optarg);
+            goto usage;
+        case 'S':
+            if (wal_parse_segment(optarg, &wal_opts) == 0)
+                break;
+            fprintf(stderr, "Wrong segment limits %s\n", optarg);
+            goto usage;
+        case 't':
+            if (parse_stack(optarg, &stack_attr) == 0){
+                client_attr = &stack_attr;
+                break;
+            }
+            fprintf(stderr, "Wrong thread stack %s, min %d kB\n", optarg, STACK_MIN_KB);
+            goto usage;
+        case 'P':
+            wal_opts.shards = strtoul(optarg, NULL, 0);
+            if (wal_opts.shards >= 1 && wal_opts.shards <= SHARD_MAX)
+                break;
+            fprintf(stderr, "Wrong number of shards %s\n", optarg);
+            goto usage;
+        case 'K':
+            if (wal_parse_retain(optarg, &wal_opts) == 0)
+                break;
+            fprintf(stderr, "Wrong retention %s\n", optarg);
+            // fall through
+        default:
+            usage: fprintf(stderr, "Usage: %s [-d] [-q] [-p port] [-f data_file] [-D channel_dir]"
+                    " [-R repl_port | -F primary_host:repl_port] [-m metrics_file]"
+                    " [-s sync|group[:ms[:bytes]]|none] [-S segment_bytes[:max_age_s]]"
+                    " [-K records[:bytes]] [-C cache_bytes] [-P shards] [-c capture_file]"
+                    " [-j cost_ns_per_byte] [-g drain_ms] [-t stack_kb[:guard_kb]]\n", argv[0]);
+            goto err;
+        }
+    }
+    if (wal_opts.shards > 1 && (wal_opts.retain_records || wal_opts.retain_bytes))
+        syslog(LOG_WARNING, "%s", "Retention is not applied to sharded log");
+    log_debug = (setlogmask(0) & LOG_MASK(LOG_DEBUG)) != 0;
+
+    // stop signals go to signalfd, every thread created later keeps them blocked
+    sigemptyset(&stop_set);
+    sigaddset(&stop_set, SIGINT);
+    sigaddset(&stop_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_set, NULL);
+
+    // Create channels (default channel mutex and backend)
+    if (channels_init(data_path, channel_dir, &wal_opts, cache_budget, sched_ns)){
+        syslog(LOG_ERR, "%s", "Error initialize channels");
         goto err;
     };
+    if (capture_path && capture_open(capture_path))
+        goto cleanup_thread;
 
     // prepare set for blocking signals
     sigemptyset(&block_set);
@@ -413,21 +748,7 @@ int main(int argc, char * argv[]){
 
 
      // Set up the signal handler using sigaction
-    struct sigaction sa_int, sa_term,sa_alrm;//, sa_io;
-
-    sa_int.sa_handler = exit_handler;
-    sigemptyset(&sa_int.sa_mask);
-    sigaddset(&sa_int.sa_mask, SIGALRM);
-    sigaddset(&sa_int.sa_mask, SIGTERM);
-    sa_int.sa_flags = 0;
-    sigaction(SIGINT, &sa_int, NULL);
-
-    sa_term.sa_handler = exit_handler;
-    sigemptyset(&sa_term.sa_mask);
-    sigaddset(&sa_term.sa_mask, SIGALRM);
-    sigaddset(&sa_term.sa_mask, SIGINT);
-    sa_term.sa_flags = 0;
-    sigaction(SIGTERM, &sa_term, NULL);
+    struct sigaction sa_alrm;//, sa_io;
 
     sa_alrm.sa_handler = timer_handler;
     sigemptyset(&sa_alrm.sa_mask);
@@ -441,7 +762,7 @@ int main(int argc, char * argv[]){
     */
 
      // Create socket file descriptor
-    if ((server_fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0)) == -1){
+    if ((server_fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0)) == -1){
         syslog(LOG_ERR, "%s: %m", "Failed to create socket");
         goto cleanup_thread;
     }
@@ -453,12 +774,14 @@ int main(int argc, char * argv[]){
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin_port = htons(port);
 
 
-     int  opt = 1;
-    // Set socket options to reuse address and enable keepalive
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR|SO_KEEPALIVE, &opt, sizeof(opt)) == -1)
+    opt = 1;
+    // Set socket options to reuse address and enable keepalive. Drain closes
+    // client sockets from server side, their port stays in TIME_WAIT after exit
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+        setsockopt(server_fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt)) == -1)
     {
         syslog(LOG_ERR, "%s: %m", "Failed to set socket options");
         goto cleanup_server;
@@ -472,48 +795,46 @@ int main(int argc, char * argv[]){
     }
 
 
-    /* Check cmd line arguments. Run as daemon if necessary */
-    if (argc>1){
-        if (strcmp(argv[1], "-d") == 0){
-            int pid = fork();
-            // error fork
-            if (pid == -1){
-                syslog(LOG_ERR, "%s: %m", "fork");
-                goto cleanup_server;
-            }
-            // parent
-            else if (pid != 0){
-                close(server_fd);
-                exit(EXIT_SUCCESS);
-            }
+    /* Run as daemon if necessary */
+    if (daemon_mode){
+        int pid = fork();
+        // error fork
+        if (pid == -1){
+            syslog(LOG_ERR, "%s: %m", "fork");
+            goto cleanup_server;
+        }
+        // parent
+        else if (pid != 0){
+            close(server_fd);
+            exit(EXIT_SUCCESS);
+        }
 
-            // Daemon section
-            if (pid == 0){
+        // Daemon section
+        if (pid == 0){
 
-                if (setsid() == -1){
-                    syslog(LOG_ERR, "%s: %m", "Error create new session");
-                    goto cleanup_server;
-                }
+            if (setsid() == -1){
+                syslog(LOG_ERR, "%s: %m", "Error create new session");
+                goto cleanup_server;
+            }
 
-                if ( chdir("/") == -1){
-                    syslog(LOG_ERR, "%s: %m", "Error chdir to /");
-                    goto cleanup_server;
-                }
+            if ( chdir("/") == -1){
+                syslog(LOG_ERR, "%s: %m", "Error chdir to /");
+                goto cleanup_server;
+            }
 
-                // redirect stdout stdin stderr
-                for (int i=0; i<3; i++)
-                    if (i != file_fd)
-                        close(i);
-                open("/dev/null", O_RDWR);
-                dup(0);
-                dup(0);
+            // redirect stdout stdin stderr
+            for (int i=0; i<3; i++)
+                if (channel_default()->be == NULL || i != channel_default()->be->fd)
+                    close(i);
+            open("/dev/null", O_RDWR);
+            dup(0);
+            dup(0);
 
-            }
         }
     }
 
     // Listen for incoming connections
-    if (listen(server_fd, MAX_CLIENTS) == -1)
+    if (listen(server_fd, LISTEN_BACKLOG) == -1)
     {
         syslog(LOG_ERR, "%s: %m", "Failed to listen for incoming connections");
         goto cleanup_server;
@@ -532,23 +853,60 @@ int main(int argc, char * argv[]){
         goto cleanup_server ;
     }*/
 
+    /* Start replication and metrics (threads are created after fork) */
+    if (repl_port && repl_primary_start(repl_port))
+        goto cleanup_server;
+    if (primary_addr && repl_follower_start(primary_addr))
+        goto cleanup_server;
+    if (metrics_path && metrics_start(metrics_path, 0))
+        goto cleanup_server;
+
     /* Loop forever accepting incoming connections */
     // Init list
 
     SLIST_INIT(&head);
 
-    while (running){
-        accept_connection();
+    if ((reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) == -1){
+        syslog(LOG_ERR, "%s: %m", "Error open reserve descriptor");
+        goto cleanup_server;
     }
 
+    int sig_fd = signalfd(-1, &stop_set, SFD_CLOEXEC);
+    if (sig_fd == -1){
+        syslog(LOG_ERR, "%s: %m", "Error create signalfd");
+        goto cleanup_server;
+    }
+    struct pollfd pfds[2] = {
+        {.fd = server_fd, .events = POLLIN},
+        {.fd = sig_fd, .events = POLLIN},
+    };
+
+    int backoff = 0, ready;
+    while (running){
+        pfds[0].events = backoff ? 0 : POLLIN;
+        if ((ready = poll(pfds, 2, backoff ? ACCEPT_BACKOFF_MS : -1)) == -1){
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "%s: %m", "Error poll");
+            break;
+        }
+        if (ready == 0)         // back off is over
+            backoff = 0;
+        else if (pfds[1].revents & POLLIN)
+            handle_signal(sig_fd);
+        else if (pfds[0].revents & POLLIN)
+            backoff = accept_connections() != 0;
+    }
+    close(sig_fd);
 
-     exit_norm();
+     exit_norm(drain_ms);
 
     /* Error section */
     cleanup_server: if (close(server_fd) == -1)
             syslog(LOG_ERR, "%s: %m", "Close server descriptor");
 
-    cleanup_thread: pthread_mutex_destroy(&lock);
+    cleanup_thread: channels_destroy();
+    capture_close();
 
     err: return -1;
 
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include "./backend.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+#define AESDCHAR_PARAM_DIR "/sys/module/aesdchar/parameters/"
+
+/*****************************************************
+*
+* aesdchar backend
+* Device is opened for every packet, position of file descriptor
+* is the response cursor. Seek is done by driver ioctl.
+*
+*****************************************************/
+
+static int chardev_begin(backend_t *be){
+    be->fd = open(be->path, O_CREAT | O_RDWR | O_APPEND | O_TRUNC | O_SYNC, 0644);
+    if (be->fd < 0) {
+        syslog(LOG_ERR, "%s %s: %m", "Failed to open data file", be->path);
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t chardev_write(backend_t *be, const char *buf, size_t count){
+    return write(be->fd, buf, count);
+}
+
+// device is opened with O_SYNC, write returns when data is in driver
+static int chardev_commit(backend_t *be){
+    return 0;
+}
+
+static int chardev_seekto(backend_t *be, uint32_t write_cmd, uint32_t write_cmd_offset){
+    struct aesd_seekto seekto = {write_cmd, write_cmd_offset};
+    return ioctl(be->fd, AESDCHAR_IOCSEEKTO, &seekto);
+}
+
+static ssize_t chardev_read(backend_t *be, char *buf, size_t count){
+    return read(be->fd, buf, count);
+}
+
+static void chardev_end(backend_t *be){
+    if (be->fd < 0)
+        return;
+    if (close(be->fd) == -1)
+        syslog(LOG_ERR, "%s: %m", "Close file");
+    be->fd = -1;
+}
+
+static void chardev_destroy(backend_t *be){
+    chardev_end(be);
+    free(be);
+}
+
+/*!
+ * Read numeric module parameter of the driver
+ * @return value or def if driver does not provide it
+ */
+static uint64_t chardev_param(const char *name, uint64_t def){
+    char path[PATH_MAX];
+    unsigned long long value;
+    FILE *f;
+
+    snprintf(path, sizeof(path), AESDCHAR_PARAM_DIR "%s", name);
+    if ((f = fopen(path, "r")) == NULL)
+        return def;
+    if (fscanf(f, "%llu", &value) != 1)
+        value = def;
+    fclose(f);
+    return value;
+}
+
+static const backend_ops_t chardev_ops = {
+    .name = "aesdchar",
+    .begin = chardev_begin,
+    .write = chardev_write,
+    .commit = chardev_commit,
+    .seekto = chardev_seekto,
+    .read = chardev_read,
+    .end = chardev_end,
+    .destroy = chardev_destroy,
+};
+
+/*****************************************************
+*
+* File backend
+* Data is stored in segmented log (directory), which is kept
+* between restarts. Response cursor is position in stream of records.
+*
+*****************************************************/
+
+static int file_begin(backend_t *be){
+    be->pos = wal_start(be->wal);
+    return 0;
+}
+
+static ssize_t file_write(backend_t *be, const char *buf, size_t count){
+    return wal_write(be->wal, buf, count);
+}
+
+static int file_commit(backend_t *be){
+    return wal_commit(be->wal);
+}
+
+static int file_seekto(backend_t *be, uint32_t write_cmd, uint32_t write_cmd_offset){
+    uint64_t pos;
+
+    if (wal_find(be->wal, write_cmd, write_cmd_offset, &pos))
+        return -1;
+    be->pos = pos;
+    return 0;
+}
+
+static ssize_t file_read(backend_t *be, char *buf, size_t count){
+    ssize_t n;
+
+    // records under cursor can be trimmed by writes of the same packet
+    if (be->pos < wal_start(be->wal))
+        be->pos = wal_start(be->wal);
+    if ((n = wal_pread(be->wal, buf, count, be->pos)) > 0)
+        be->pos += n;
+    return n;
+}
+
+static void file_end(backend_t *be){
+}
+
+static void file_destroy(backend_t *be){
+    wal_close(be->wal);
+    free(be);
+}
+
+static const backend_ops_t file_ops = {
+    .name = "file",
+    .begin = file_begin,
+    .write = file_write,
+    .commit = file_commit,
+    .seekto = file_seekto,
+    .read = file_read,
+    .end = file_end,
+    .destroy = file_destroy,
+};
+
+/*****************************************************
+*
+* Common
+*
+*****************************************************/
+
+backend_t *backend_create(const char *path, const wal_opts_t *opts){
+    struct stat st;
+    backend_t *be = malloc(sizeof(backend_t));
+
+    if (be == NULL){
+        syslog(LOG_ERR, "%s: %m", "Error allocate memory for backend");
+        return NULL;
+    }
+    memset(be, 0, sizeof(backend_t));
+    be->fd = -1;
+    if (strlen(path) >= sizeof(be->path)){
+        syslog(LOG_ERR, "Path too long %s", path);
+        free(be);
+        return NULL;
+    }
+    strcpy(be->path, path);
+
+    if (stat(path, &st) == 0 && S_ISCHR(st.st_mode)){
+        be->ops = &chardev_ops;
+        // window is set by module parameters of the driver
+        be->window_records = chardev_param("capacity", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+        be->window_bytes = chardev_param("max_bytes", 0);
+        // mapped data area evicts by its fill with padding, cache would serve dropped commands
+        be->no_cache = chardev_param("mmap_kb", 0) != 0;
+        // driver drops unterminated command when device file is closed
+        be->drops_partial = 1;
+    }
+    else{
+        be->ops = &file_ops;
+        if ((be->wal = wal_open(path, opts)) == NULL){
+            free(be);
+            return NULL;
+        }
+        be->window_records = be->wal->opts.retain_records;
+        be->window_bytes = be->wal->opts.retain_bytes;
+    }
+
+    syslog(LOG_DEBUG, "%s backend for %s", be->ops->name, path);
+    return be;
+}
@@ -0,0 +1,64 @@
+/*
+ * backend.h
+ *
+ * Storage backends for aesdsocket channels.
+ * Every channel owns one backend instance. The backend stores packets
+ * and provides the response cursor which is read back to the client.
+ */
+
+#ifndef AESDSOCKET_BACKEND_H
+#define AESDSOCKET_BACKEND_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+#include "./wal.h"
+
+typedef struct backend_s backend_t;
+typedef struct backend_ops_s backend_ops_t;
+
+/*
+ * Operations of backend. All calls must be done under channel lock.
+ * begin/end bracket one packet (write part and response part).
+ * commit is called when write part of packet is done, before response.
+ */
+struct backend_ops_s{
+    const char *name;
+    int (*begin)(backend_t *be);
+    ssize_t (*write)(backend_t *be, const char *buf, size_t count);
+    int (*commit)(backend_t *be);
+    int (*seekto)(backend_t *be, uint32_t write_cmd, uint32_t write_cmd_offset);
+    ssize_t (*read)(backend_t *be, char *buf, size_t count);
+    void (*end)(backend_t *be);
+    void (*destroy)(backend_t *be);
+};
+
+struct backend_s{
+    const backend_ops_t *ops;
+    char path[PATH_MAX];
+    int fd;         /* aesdchar backend, open while packet processed */
+    struct wal_s *wal;  /* file backend */
+    uint64_t pos;   /* response cursor (file backend) */
+    uint64_t window_records;    /* backend keeps last records, 0 - all */
+    uint64_t window_bytes;      /* backend keeps last bytes, 0 - all */
+    int no_cache;               /* backend evicts by rules window can't describe */
+    int drops_partial;          /* unterminated command is dropped at end of packet */
+};
+
+/*!
+ * Create backend for path. Char device gets aesdchar backend (ioctl seek),
+ * anything else is directory of persistent segmented log (file backend).
+ * @param opts log options of file backend, NULL for defaults
+ * @return new backend or NULL on error
+ */
+backend_t *backend_create(const char *path, const wal_opts_t *opts);
+
+#define backend_begin(be)           ((be)->ops->begin(be))
+#define backend_write(be, buf, cnt) ((be)->ops->write((be), (buf), (cnt)))
+#define backend_commit(be)          ((be)->ops->commit(be))
+#define backend_seekto(be, cmd, offs) ((be)->ops->seekto((be), (cmd), (offs)))
+#define backend_read(be, buf, cnt)  ((be)->ops->read((be), (buf), (cnt)))
+#define backend_end(be)             ((be)->ops->end(be))
+#define backend_destroy(be)         ((be)->ops->destroy(be))
+
+#endif /* AESDSOCKET_BACKEND_H */
@@ -0,0 +1,382 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "./cache.h"
+#include "./ebr.h"
+#include "./metrics.h"
+
+#define CACHE_IOV 64
+
+/*****************************************************
+*
+* References
+*
+*****************************************************/
+
+static void cache_chunk_put(cache_chunk_t *chunk){
+    if (__atomic_sub_fetch(&chunk->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        free(chunk);
+}
+
+static void cache_vec_put(cache_vec_t *vec){
+    if (vec == NULL || __atomic_sub_fetch(&vec->refcnt, 1, __ATOMIC_ACQ_REL))
+        return;
+    for (size_t i = 0; i < vec->n; i++)
+        cache_chunk_put(vec->recs[i].chunk);
+    free(vec);
+}
+
+void cache_put(cache_snap_t *snap){
+    if (snap == NULL || __atomic_sub_fetch(&snap->refcnt, 1, __ATOMIC_ACQ_REL))
+        return;
+    cache_vec_put(snap->vec);
+    free(snap);
+}
+
+static void cache_put_retired(void *snap){
+    cache_put(snap);
+}
+
+cache_snap_t *cache_get(cache_t *cache){
+    cache_snap_t *snap;
+
+    // snapshot can't be freed inside section, reference keeps it after
+    ebr_enter();
+    if ((snap = __atomic_load_n(&cache->snap, __ATOMIC_ACQUIRE)) != NULL)
+        __atomic_add_fetch(&snap->refcnt, 1, __ATOMIC_RELAXED);
+    ebr_exit();
+    return snap;
+}
+
+/*!
+ * Replace current snapshot, NULL disables responses from cache
+ */
+static void cache_set(cache_t *cache, cache_snap_t *snap){
+    cache_snap_t *old = __atomic_exchange_n(&cache->snap, snap, __ATOMIC_SEQ_CST);
+
+    // readers can still be taking reference of old snapshot
+    if (old)
+        ebr_retire(old, cache_put_retired);
+    ebr_reclaim();
+}
+
+/*****************************************************
+*
+* Writer
+*
+*****************************************************/
+
+/*!
+ * Cache can't follow backend any more (no memory), responses go to backend
+ */
+static void cache_disable(cache_t *cache){
+    syslog(LOG_ERR, "%s", "Response cache disabled");
+    cache->budget = 0;
+    cache_set(cache, NULL);
+}
+
+/*!
+ * Make room for one record. Vector is replaced when full or
+ * when too much memory is held by dropped records.
+ */
+static int cache_vec_reserve(cache_t *cache){
+    cache_vec_t *vec = cache->vec, *new_vec;
+    size_t live = vec ? vec->n - cache->lo : 0, cap;
+
+    if (vec && vec->n < vec->cap && cache->dead_bytes <= cache->budget / 2)
+        return 0;
+
+    cap = live * 2 > CACHE_VEC_MIN ? live * 2 : CACHE_VEC_MIN;
+    if ((new_vec = malloc(sizeof(cache_vec_t) + cap * sizeof(cache_rec_t))) == NULL)
+        return -1;
+    new_vec->refcnt = 1;
+    new_vec->cap = cap;
+    new_vec->n = live;
+    for (size_t i = 0; i < live; i++){
+        new_vec->recs[i] = vec->recs[cache->lo + i];
+        __atomic_add_fetch(&new_vec->recs[i].chunk->refcnt, 1, __ATOMIC_RELAXED);
+    }
+    cache_vec_put(vec);
+    cache->vec = new_vec;
+    cache->lo = 0;
+    cache->dead_bytes = 0;
+    return 0;
+}
+
+/*!
+ * Count record as skipped (visible in backend, not cached)
+ */
+static int cache_skip_push(cache_t *cache, uint64_t size){
+    uint64_t *sizes;
+    size_t cap;
+
+    cache->skipped++;
+    if (!cache->max_bytes)
+        return 0;
+    if (cache->skip_head + cache->skipped > cache->skip_cap){
+        if (cache->skip_head){
+            memmove(cache->skip_sizes, cache->skip_sizes + cache->skip_head,
+                    (cache->skipped - 1) * sizeof(uint64_t));
+            cache->skip_head = 0;
+        }
+        if (cache->skipped > cache->skip_cap){
+            cap = cache->skip_cap ? cache->skip_cap * 2 : CACHE_VEC_MIN;
+            if ((sizes = realloc(cache->skip_sizes, cap * sizeof(uint64_t))) == NULL)
+                return -1;
+            cache->skip_sizes = sizes;
+            cache->skip_cap = cap;
+        }
+    }
+    cache->skip_sizes[cache->skip_head + cache->skipped - 1] = size;
+    return 0;
+}
+
+static uint64_t cache_front_size(cache_t *cache){
+    if (cache->skipped)
+        return cache->max_bytes ? cache->skip_sizes[cache->skip_head] : 0;
+    return cache->vec->recs[cache->lo].chunk->size;
+}
+
+/*!
+ * Remove oldest visible record
+ */
+static void cache_drop_front(cache_t *cache, uint64_t *visible_bytes){
+    uint64_t size = cache_front_size(cache);
+
+    if (cache->skipped){
+        cache->skipped--;
+        cache->skip_head = cache->skipped ? cache->skip_head + 1 : 0;
+    }
+    else{
+        cache->lo++;
+        cache->bytes -= size;
+        cache->dead_bytes += size;
+    }
+    *visible_bytes -= size;
+}
+
+/*!
+ * Oldest cached record becomes skipped
+ */
+static int cache_evict_front(cache_t *cache){
+    uint64_t size = cache->vec->recs[cache->lo].chunk->size;
+
+    cache->lo++;
+    cache->bytes -= size;
+    cache->dead_bytes += size;
+    return cache_skip_push(cache, size);
+}
+
+static int cache_add_rec(cache_t *cache, const char *data, size_t size){
+    cache_chunk_t *chunk = malloc(sizeof(cache_chunk_t) + size);
+    cache_rec_t *rec;
+
+    if (chunk == NULL || cache_vec_reserve(cache)){
+        free(chunk);
+        // keep skipped records a prefix of visible records
+        while (cache->vec && cache->lo < cache->vec->n)
+            if (cache_evict_front(cache))
+                return -1;
+        return cache_skip_push(cache, size);
+    }
+    chunk->refcnt = 1;
+    chunk->size = size;
+    memcpy(chunk->data, data, size);
+
+    rec = &cache->vec->recs[cache->vec->n];
+    rec->pos = cache->next_pos;
+    rec->chunk = chunk;
+    // publish record before it becomes part of snapshot
+    __atomic_store_n(&cache->vec->n, cache->vec->n + 1, __ATOMIC_RELEASE);
+    cache->next_pos += size;
+    cache->bytes += size;
+    return 0;
+}
+
+/*!
+ * Apply window of backend and memory budget
+ */
+static int cache_trim(cache_t *cache){
+    size_t live = cache->vec ? cache->vec->n - cache->lo : 0;
+    uint64_t visible = cache->skipped + live, visible_bytes = cache->bytes;
+
+    if (cache->max_bytes)
+        for (size_t i = 0; i < cache->skipped; i++)
+            visible_bytes += cache->skip_sizes[cache->skip_head + i];
+
+    while (visible && ((cache->max_records && visible > cache->max_records) ||
+           (cache->max_bytes && visible > 1 && visible_bytes > cache->max_bytes))){
+        cache_drop_front(cache, &visible_bytes);
+        visible--;
+    }
+    while (cache->bytes > cache->budget && cache->lo < cache->vec->n)
+        if (cache_evict_front(cache))
+            return -1;
+    return 0;
+}
+
+static int cache_publish(cache_t *cache){
+    cache_snap_t *snap = malloc(sizeof(cache_snap_t));
+
+    if (snap == NULL)
+        return -1;
+    snap->refcnt = 1;
+    snap->version = ++cache->version;
+    snap->vec = cache->vec;
+    if (snap->vec)
+        __atomic_add_fetch(&snap->vec->refcnt, 1, __ATOMIC_RELAXED);
+    snap->lo = cache->lo;
+    snap->hi = cache->vec ? cache->vec->n : 0;
+    snap->skipped = cache->skipped;
+    cache_set(cache, snap);
+
+    metric_set(metric_cached("cache_version"), snap->version);
+    metric_set(metric_cached("cache_bytes"), cache->bytes);
+    return 0;
+}
+
+static int cache_pending_add(cache_t *cache, const char *data, size_t size){
+    char *pending;
+    size_t cap = cache->pending_cap ? cache->pending_cap : CACHE_VEC_MIN;
+
+    while (cap < cache->pending_size + size)
+        cap *= 2;
+    if (cap != cache->pending_cap){
+        if ((pending = realloc(cache->pending, cap)) == NULL)
+            return -1;
+        cache->pending = pending;
+        cache->pending_cap = cap;
+    }
+    memcpy(cache->pending + cache->pending_size, data, size);
+    cache->pending_size += size;
+    return 0;
+}
+
+void cache_append(cache_t *cache, const char *data, size_t size){
+    const char *pos = data, *end = data + size, *nl;
+    int err = 0;
+
+    if (cache->budget == 0)
+        return;
+    while (!err && (nl = memchr(pos, '\n', end - pos)) != NULL){
+        if (cache->pending_size){
+            err = cache_pending_add(cache, pos, nl - pos + 1) ||
+                  cache_add_rec(cache, cache->pending, cache->pending_size);
+            cache->pending_size = 0;
+        }
+        else
+            err = cache_add_rec(cache, pos, nl - pos + 1);
+        pos = nl + 1;
+    }
+    if (!err && pos < end)
+        err = cache_pending_add(cache, pos, end - pos);
+
+    if (err || cache_trim(cache) || cache_publish(cache))
+        cache_disable(cache);
+}
+
+cache_t *cache_create(uint64_t max_records, uint64_t max_bytes, size_t budget){
+    cache_t *cache = malloc(sizeof(cache_t));
+
+    if (cache == NULL){
+        syslog(LOG_ERR, "%s: %m", "Error allocate memory for cache");
+        return NULL;
+    }
+    memset(cache, 0, sizeof(cache_t));
+    cache->max_records = max_records;
+    cache->max_bytes = max_bytes;
+    // byte window is cached completely, sizes of skipped records are kept for it
+    cache->budget = budget && budget < max_bytes ? max_bytes : budget;
+    if (cache->budget && cache_publish(cache)){
+        cache_destroy(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void cache_destroy(cache_t *cache){
+    cache_set(cache, NULL);
+    cache_vec_put(cache->vec);
+    free(cache->skip_sizes);
+    free(cache->pending);
+    free(cache);
+}
+
+/*****************************************************
+*
+* Readers
+*
+*****************************************************/
+
+int cache_seek(cache_snap_t *snap, const uint32_t *cmd, uint32_t offs, uint64_t *pos){
+    cache_rec_t *rec;
+
+    if (snap == NULL)
+        return -1;
+    if (cmd && *cmd >= snap->skipped && *cmd - snap->skipped < snap->hi - snap->lo){
+        rec = &snap->vec->recs[snap->lo + *cmd - snap->skipped];
+        if (offs < rec->chunk->size){
+            *pos = rec->pos + offs;
+            metric_add(metric_cached("cache_hits"), 1);
+            return 0;
+        }
+    }
+    // wrong seek is ignored by backends, response starts from first record
+    if (snap->skipped || (cmd && *cmd < snap->skipped)){
+        metric_add(metric_cached("cache_misses"), 1);
+        return -1;
+    }
+    *pos = snap->lo < snap->hi ? snap->vec->recs[snap->lo].pos : 0;
+    metric_add(metric_cached("cache_hits"), 1);
+    return 0;
+}
+
+/*!
+ * @return record of snapshot which contains pos or hi
+ */
+static size_t cache_find(cache_snap_t *snap, uint64_t pos){
+    size_t lo = snap->lo, hi = snap->hi, mid;
+    cache_rec_t *rec;
+
+    while (lo < hi){
+        mid = lo + (hi - lo) / 2;
+        rec = &snap->vec->recs[mid];
+        if (pos < rec->pos)
+            hi = mid;
+        else if (pos >= rec->pos + rec->chunk->size)
+            lo = mid + 1;
+        else
+            return mid;
+    }
+    return snap->hi;
+}
+
+ssize_t cache_send(cache_snap_t *snap, int fd, uint64_t pos){
+    struct iovec iov[CACHE_IOV];
+    struct msghdr msg;
+    cache_rec_t *rec;
+    size_t i, cnt;
+    ssize_t n, total = 0;
+
+    while ((i = cache_find(snap, pos)) < snap->hi){
+        for (cnt = 0; cnt < CACHE_IOV && i < snap->hi; cnt++, i++){
+            rec = &snap->vec->recs[i];
+            iov[cnt].iov_base = rec->chunk->data + (pos > rec->pos ? pos - rec->pos : 0);
+            iov[cnt].iov_len = rec->chunk->size - (pos > rec->pos ? pos - rec->pos : 0);
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        if ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0){
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        pos += n;
+        total += n;
+    }
+    return total;
+}
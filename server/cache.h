@@ -0,0 +1,126 @@
+/*
+ * cache.h
+ *
+ * Shared in-memory copy of visible records of channel used for responses.
+ * Every committed record is copied once into immutable refcounted chunk.
+ * After commit new version of snapshot is published. Response holds
+ * reference to snapshot and sends its chunks, so all clients answered
+ * after the same commit share one copy and don't read backend.
+ *
+ * Unterminated data is kept as pending record and is completed by the next
+ * commit, as in file backend. aesdchar drops unterminated command of closed
+ * file, channel doesn't pass it to cache then.
+ *
+ * Cache keeps the same window as backend (last N records and/or B bytes)
+ * and not more than budget bytes. Visible records which don't fit into
+ * budget are counted as skipped; responses which start in them are
+ * served by backend.
+ *
+ * Snapshot is immutable, so response is sent from it without channel lock
+ * while writers commit new versions. Current snapshot pointer is read in
+ * epoch section (ebr.h) and replaced one is freed by epoch reclamation,
+ * readers don't take any lock.
+ */
+
+#ifndef AESDSOCKET_CACHE_H
+#define AESDSOCKET_CACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CACHE_BUDGET (16 * 1024 * 1024)
+#define CACHE_VEC_MIN 64
+
+typedef struct cache_chunk_s cache_chunk_t;
+struct cache_chunk_s{
+    int refcnt;
+    size_t size;
+    char data[];
+};
+
+typedef struct cache_rec_s cache_rec_t;
+struct cache_rec_s{
+    uint64_t pos;       /* position in stream of cache */
+    cache_chunk_t *chunk;
+};
+
+/* Append only array of records shared by snapshots */
+typedef struct cache_vec_s cache_vec_t;
+struct cache_vec_s{
+    int refcnt;
+    size_t n, cap;
+    cache_rec_t recs[];
+};
+
+typedef struct cache_snap_s cache_snap_t;
+struct cache_snap_s{
+    int refcnt;
+    uint64_t version;
+    cache_vec_t *vec;
+    size_t lo, hi;          /* records of snapshot are vec->recs[lo..hi) */
+    uint64_t skipped;       /* visible records before lo, not cached */
+};
+
+typedef struct cache_s cache_t;
+struct cache_s{
+    cache_snap_t *snap;     /* current version, epoch protected */
+
+    /* writer state, changed under channel lock */
+    cache_vec_t *vec;
+    size_t lo;
+    uint64_t skipped;
+    uint64_t *skip_sizes;   /* sizes of skipped records, byte window only */
+    size_t skip_head, skip_cap;
+    uint64_t version;
+    uint64_t next_pos;
+    size_t bytes;           /* bytes of records [lo, n) */
+    size_t dead_bytes;      /* bytes of records [0, lo) still in vec */
+
+    uint64_t max_records, max_bytes;
+    size_t budget;
+
+    /* unterminated record */
+    char *pending;
+    size_t pending_size, pending_cap;
+};
+
+/*!
+ * @param max_records window of backend, 0 - no limit
+ * @param max_bytes window of backend, 0 - no limit
+ * @param budget max bytes of cached records
+ * @return cache or NULL on error
+ */
+cache_t *cache_create(uint64_t max_records, uint64_t max_bytes, size_t budget);
+
+void cache_destroy(cache_t *cache);
+
+/*!
+ * Committed data. Every newline terminated command becomes a record,
+ * new snapshot is published. Must be called under channel lock.
+ */
+void cache_append(cache_t *cache, const char *data, size_t size);
+
+/*!
+ * @return reference to current snapshot, NULL if cache is disabled
+ */
+cache_snap_t *cache_get(cache_t *cache);
+
+void cache_put(cache_snap_t *snap);
+
+/*!
+ * Find start of response like backend seekto does
+ * @param cmd record counted from first visible record, offs offset in it,
+ *        NULL for start of visible data
+ * @param pos position in snapshot
+ * @return 0 on success, -1 if response needs records not in cache
+ *         or snap is NULL
+ */
+int cache_seek(cache_snap_t *snap, const uint32_t *cmd, uint32_t offs, uint64_t *pos);
+
+/*!
+ * Send data of snapshot from pos to the end
+ * @return bytes sent or -1 on error
+ */
+ssize_t cache_send(cache_snap_t *snap, int fd, uint64_t pos);
+
+#endif /* AESDSOCKET_CACHE_H */
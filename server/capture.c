@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include "./capture.h"
+#include "./metrics.h"
+
+static FILE *capture_file = NULL;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec capture_start;
+static uint32_t capture_next_conn = 1;
+
+/*!
+ * Write record, must be called under capture lock
+ */
+static void capture_write(uint32_t conn, uint16_t type, const char *data, size_t size){
+    capture_rec_t rec;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec.time = htole64((ts.tv_sec - capture_start.tv_sec) * 1000000000ULL + ts.tv_nsec - capture_start.tv_nsec);
+    rec.conn = htole32(conn);
+    rec.type = htole16(type);
+    rec.reserved = 0;
+    rec.size = htole32(size);
+    if (fwrite(&rec, sizeof(rec), 1, capture_file) != 1 ||
+        (size && fwrite(data, size, 1, capture_file) != 1)){
+        syslog(LOG_ERR, "%s: %m", "Error write capture, capture stopped");
+        fclose(capture_file);
+        capture_file = NULL;
+        return;
+    }
+    metric_add(metric_cached("capture_bytes"), sizeof(rec) + size);
+}
+
+int capture_open(const char *path){
+    capture_hdr_t hdr;
+    struct timespec now;
+
+    if ((capture_file = fopen(path, "w")) == NULL){
+        syslog(LOG_ERR, "%s %s: %m", "Error open capture file", path);
+        return -1;
+    }
+    setvbuf(capture_file, NULL, _IOFBF, CAPTURE_BUF_SIZE);
+    clock_gettime(CLOCK_REALTIME, &now);
+    clock_gettime(CLOCK_MONOTONIC, &capture_start);
+    memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+    hdr.start = htole64(now.tv_sec * 1000000000ULL + now.tv_nsec);
+    // flushed before daemon fork, parent must not write buffer again
+    if (fwrite(&hdr, sizeof(hdr), 1, capture_file) != 1 || fflush(capture_file) == EOF){
+        syslog(LOG_ERR, "%s %s: %m", "Error write capture file", path);
+        fclose(capture_file);
+        capture_file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void capture_close(void){
+    pthread_mutex_lock(&capture_lock);
+    if (capture_file && fclose(capture_file) == EOF)
+        syslog(LOG_ERR, "%s: %m", "Error close capture file");
+    capture_file = NULL;
+    pthread_mutex_unlock(&capture_lock);
+}
+
+uint32_t capture_conn(void){
+    uint32_t conn = 0;
+
+    // checked without lock, capture is started before connections
+    if (capture_file == NULL)
+        return 0;
+    pthread_mutex_lock(&capture_lock);
+    if (capture_file){
+        conn = capture_next_conn++;
+        capture_write(conn, CAPTURE_OPEN, NULL, 0);
+    }
+    pthread_mutex_unlock(&capture_lock);
+    return conn;
+}
+
+void capture_data(uint32_t conn, const char *data, size_t size){
+    if (conn == 0)
+        return;
+    pthread_mutex_lock(&capture_lock);
+    if (capture_file)
+        capture_write(conn, CAPTURE_DATA, data, size);
+    pthread_mutex_unlock(&capture_lock);
+}
+
+void capture_end(uint32_t conn){
+    if (conn == 0)
+        return;
+    pthread_mutex_lock(&capture_lock);
+    if (capture_file){
+        capture_write(conn, CAPTURE_CLOSE, NULL, 0);
+        // finished connections survive crash of server
+        if (capture_file)
+            fflush(capture_file);
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
@@ -0,0 +1,61 @@
+/*
+ * capture.h
+ *
+ * Traffic capture of aesdsocket (-c option) for replay by aesdreplay.
+ * Every chunk returned by recv() of client connection is stored with its
+ * time, so replay reproduces fragmentation of packets and commands.
+ *
+ * File is capture_hdr followed by records: capture_rec and size bytes of
+ * data. Integers are little endian, time is nanoseconds from capture start.
+ */
+
+#ifndef AESDSOCKET_CAPTURE_H
+#define AESDSOCKET_CAPTURE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CAPTURE_MAGIC "AESDCAP1"
+#define CAPTURE_BUF_SIZE (64 * 1024)
+
+#define CAPTURE_OPEN 1      /* connection accepted */
+#define CAPTURE_DATA 2      /* data received */
+#define CAPTURE_CLOSE 3     /* connection finished */
+
+typedef struct capture_hdr_s capture_hdr_t;
+struct capture_hdr_s{
+    char magic[8];
+    uint64_t start;         /* wall clock of capture start, ns */
+} __attribute__((packed));
+
+typedef struct capture_rec_s capture_rec_t;
+struct capture_rec_s{
+    uint64_t time;
+    uint32_t conn;          /* connection id, from 1 */
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t size;          /* bytes of data after record */
+} __attribute__((packed));
+
+/*!
+ * Start capture to path, file is truncated
+ * @return 0 on success
+ */
+int capture_open(const char *path);
+
+void capture_close(void);
+
+/*!
+ * Register new connection
+ * @return connection id, 0 if capture is off
+ */
+uint32_t capture_conn(void);
+
+void capture_data(uint32_t conn, const char *data, size_t size);
+
+/*!
+ * Connection finished, records of it are flushed to file
+ */
+void capture_end(uint32_t conn);
+
+#endif /* AESDSOCKET_CAPTURE_H */
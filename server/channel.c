@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "./channel.h"
+#include "./repl.h"
+#include "./ebr.h"
+#include "./metrics.h"
+
+static SLIST_HEAD(chlisthead, channel_s) channels = SLIST_HEAD_INITIALIZER(channels);
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+static channel_t *default_channel = NULL;
+static char channel_dir[PATH_MAX];
+static wal_opts_t wal_opts = WAL_OPTS_DEFAULT;
+static size_t cache_budget = CACHE_BUDGET;
+static uint64_t sched_ns = 0;
+
+/* Response from merged shards */
+typedef struct log_resp_s log_resp_t;
+struct log_resp_s{
+    int fd;
+    int seek;           /* records before cmd are skipped */
+    uint64_t rec;
+    uint32_t cmd, offs;
+    int err;
+};
+
+static int channel_fill_rec(void *arg, const char *data, size_t size){
+    cache_append(arg, data, size);
+    return 0;
+}
+
+/*!
+ * Load data visible in backend to response cache
+ */
+static void channel_cache_fill(channel_t *ch){
+    char buf[4096];
+    ssize_t n;
+
+    if (ch->slog){
+        shard_scan(ch->slog, channel_fill_rec, ch->cache);
+        return;
+    }
+    if (backend_begin(ch->be))
+        return;
+    while ((n = backend_read(ch->be, buf, sizeof(buf))) > 0)
+        cache_append(ch->cache, buf, n);
+    backend_end(ch->be);
+}
+
+/*!
+ * Packets of sharded log in commit order
+ */
+static void channel_sink(void *arg, const char *data, size_t size){
+    channel_t *ch = arg;
+
+    if (ch->cache)
+        cache_append(ch->cache, data, size);
+    repl_publish(ch->name, data, size);
+}
+
+static channel_t *channel_create(const char *name, const char *path){
+    struct stat st;
+    channel_t *ch = malloc(sizeof(channel_t));
+    if (ch == NULL){
+        syslog(LOG_ERR, "%s: %m", "Error allocate memory for channel");
+        return NULL;
+    }
+    memset(ch, 0, sizeof(channel_t));
+    strcpy(ch->name, name);
+
+    if (pthread_mutex_init(&ch->lock, NULL) != 0){
+        syslog(LOG_ERR, "%s: %m", "Error initialize channel mutex");
+        free(ch);
+        return NULL;
+    }
+    pthread_mutex_init(&ch->sched_lock, NULL);
+    TAILQ_INIT(&ch->waiters);
+    ch->sched_ns = sched_ns;
+
+    // char device has own capacity, shards are for file log only
+    if (wal_opts.shards > 1 && !(stat(path, &st) == 0 && S_ISCHR(st.st_mode)))
+        ch->slog = shard_open(path, &wal_opts, channel_sink, ch);
+    else
+        ch->be = backend_create(path, &wal_opts);
+    if (ch->be == NULL && ch->slog == NULL){
+        pthread_mutex_destroy(&ch->sched_lock);
+        pthread_mutex_destroy(&ch->lock);
+        free(ch);
+        return NULL;
+    }
+    // without cache responses are read from backend
+    if (cache_budget && !(ch->be && ch->be->no_cache) &&
+        (ch->cache = cache_create(ch->be ? ch->be->window_records : 0,
+                                  ch->be ? ch->be->window_bytes : 0, cache_budget)) != NULL)
+        channel_cache_fill(ch);
+    syslog(LOG_DEBUG, "Channel '%s' created at %s", name, path);
+    return ch;
+}
+
+static void channel_free(channel_t *ch){
+    if (ch->cache)
+        cache_destroy(ch->cache);
+    if (ch->slog)
+        shard_close(ch->slog);
+    else
+        backend_destroy(ch->be);
+    pthread_mutex_destroy(&ch->sched_lock);
+    pthread_mutex_destroy(&ch->lock);
+    free(ch);
+}
+
+int channel_name_valid(const char *name){
+    size_t len = strlen(name);
+
+    if (len == 0 || len > CHANNEL_NAME_MAX)
+        return 0;
+    for (size_t i = 0; i < len; i++)
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_' && name[i] != '-')
+            return 0;
+    return 1;
+}
+
+int channels_init(const char *default_path, const char *dir, const wal_opts_t *opts,
+                  size_t cache_size, uint64_t sched_cost_ns){
+    char cwd[PATH_MAX] = "";
+
+    if (opts)
+        wal_opts = *opts;
+    cache_budget = cache_size;
+    sched_ns = sched_cost_ns;
+
+    // keep directory absolute, daemon changes working directory
+    if (dir[0] != '/' && getcwd(cwd, sizeof(cwd)) == NULL){
+        syslog(LOG_ERR, "%s: %m", "Error get working directory");
+        return -1;
+    }
+    if (snprintf(channel_dir, sizeof(channel_dir), "%s%s%s", cwd, *cwd ? "/" : "", dir)
+            >= (int)sizeof(channel_dir) - CHANNEL_NAME_MAX - 1){
+        syslog(LOG_ERR, "Channel directory name too long %s", dir);
+        return -1;
+    }
+
+    if ((default_channel = channel_create("", default_path)) == NULL)
+        return -1;
+    SLIST_INSERT_HEAD(&channels, default_channel, next);
+    return 0;
+}
+
+channel_t *channel_default(void){
+    return default_channel;
+}
+
+int channels_file(const char *file, char *path, size_t size){
+    if (mkdir(channel_dir, 0755) == -1 && errno != EEXIST){
+        syslog(LOG_ERR, "%s %s: %m", "Error create channel directory", channel_dir);
+        return -1;
+    }
+    if (snprintf(path, size, "%s/%s", channel_dir, file) >= (int)size){
+        syslog(LOG_ERR, "File name too long %s", file);
+        return -1;
+    }
+    return 0;
+}
+
+channel_t *channel_get(const char *name){
+    channel_t *ch = NULL;
+    char path[PATH_MAX + CHANNEL_NAME_MAX + 2];
+
+    if (name == NULL || *name == '\0')
+        return default_channel;
+
+    if (!channel_name_valid(name)){
+        syslog(LOG_ERR, "Wrong channel name %s", name);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&channels_lock);
+    SLIST_FOREACH(ch, &channels, next)
+        if (strcmp(ch->name, name) == 0)
+            goto out;
+
+    // directory is created on first named channel
+    if (channels_file(name, path, sizeof(path)))
+        goto out;
+    if ((ch = channel_create(name, path)) != NULL)
+        SLIST_INSERT_HEAD(&channels, ch, next);
+
+    out: pthread_mutex_unlock(&channels_lock);
+    return ch;
+}
+
+void channels_destroy(void){
+    channel_t *ch = NULL;
+
+    pthread_mutex_lock(&channels_lock);
+    while (!SLIST_EMPTY(&channels)){
+        ch = SLIST_FIRST(&channels);
+        SLIST_REMOVE_HEAD(&channels, next);
+        channel_free(ch);
+    }
+    default_channel = NULL;
+    pthread_mutex_unlock(&channels_lock);
+    // connections are finished, snapshots retired by caches can go
+    ebr_drain();
+}
+
+/*****************************************************
+*
+* Packet scheduler
+*
+*****************************************************/
+
+/*!
+ * Pass turn to the best waiter
+ */
+static void sched_release(channel_t *ch){
+    sched_waiter_t *w;
+
+    pthread_mutex_lock(&ch->sched_lock);
+    if ((w = TAILQ_FIRST(&ch->waiters)) != NULL){
+        TAILQ_REMOVE(&ch->waiters, w, next);
+        w->granted = 1;
+        pthread_cond_signal(&w->cond);
+    }
+    else
+        ch->sched_busy = 0;
+    pthread_mutex_unlock(&ch->sched_lock);
+}
+
+int channel_lock(channel_t *ch, size_t cost){
+    sched_waiter_t w, *it;
+    struct timespec now;
+
+    if (ch->sched_ns){
+        pthread_mutex_lock(&ch->sched_lock);
+        if (ch->sched_busy){
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            w.key = now.tv_sec * 1000000000ULL + now.tv_nsec + cost * ch->sched_ns;
+            w.granted = 0;
+            pthread_cond_init(&w.cond, NULL);
+            TAILQ_FOREACH(it, &ch->waiters, next)
+                if (it->key > w.key)
+                    break;
+            if (it)
+                TAILQ_INSERT_BEFORE(it, &w, next);
+            else
+                TAILQ_INSERT_TAIL(&ch->waiters, &w, next);
+            metric_add(metric_cached("sched_waiting"), 1);
+
+            // turn is handed over by sched_release, busy stays set
+            while (!w.granted)
+                pthread_cond_wait(&w.cond, &ch->sched_lock);
+            pthread_cond_destroy(&w.cond);
+            metric_add(metric_cached("sched_waiting"), -1);
+        }
+        ch->sched_busy = 1;
+        pthread_mutex_unlock(&ch->sched_lock);
+    }
+    if (pthread_mutex_lock(&ch->lock)){
+        syslog(LOG_ERR, "%s: %m", "Failed to lock mutex");
+        if (ch->sched_ns)
+            sched_release(ch);
+        return -1;
+    }
+    return 0;
+}
+
+void channel_unlock(channel_t *ch){
+    pthread_mutex_unlock(&ch->lock);
+    if (ch->sched_ns)
+        sched_release(ch);
+}
+
+/*****************************************************
+*
+* Packets
+*
+*****************************************************/
+
+size_t channel_write(channel_t *ch, const char *data, size_t size){
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < size){
+        if ((n = backend_write(ch->be, data + done, size - done)) <= 0){
+            syslog(LOG_ERR, "%s: %m", "Error write packet");
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+int channel_commit(channel_t *ch, const char *data, size_t size){
+    // unterminated end of packet is not stored by such backend, cache and followers don't get it
+    if (ch->be->drops_partial)
+        while (size && data[size - 1] != '\n')
+            size--;
+    // written data is visible in backend even if sync fails, cache follows it
+    if (size && ch->cache)
+        cache_append(ch->cache, data, size);
+    if (backend_commit(ch->be)){
+        syslog(LOG_ERR, "Error commit packet of channel '%s'", ch->name);
+        return -1;
+    }
+    if (size)
+        repl_publish(ch->name, data, size);
+    return 0;
+}
+
+cache_snap_t *channel_snapshot(channel_t *ch){
+    return ch->cache ? cache_get(ch->cache) : NULL;
+}
+
+int channel_append(channel_t *ch, const char *data, size_t size){
+    if (shard_append(ch->slog, data, size)){
+        syslog(LOG_ERR, "Error append packet of channel '%s'", ch->name);
+        return -1;
+    }
+    return 0;
+}
+
+static int channel_send_rec(void *arg, const char *data, size_t size){
+    log_resp_t *resp = arg;
+    size_t offs = 0;
+
+    if (resp->seek){
+        if (resp->rec++ < resp->cmd)
+            return 0;
+        // wrong seek is ignored like by backends
+        if (resp->offs >= size)
+            return 1;
+        offs = resp->offs;
+        resp->seek = 0;
+    }
+    if (send(resp->fd, data + offs, size - offs, MSG_NOSIGNAL) < (ssize_t)(size - offs)){
+        resp->err = 1;
+        return 1;
+    }
+    return 0;
+}
+
+int channel_send_log(channel_t *ch, int fd, const uint32_t *cmd, uint32_t offs){
+    log_resp_t resp = {.fd = fd, .seek = cmd != NULL, .cmd = cmd ? *cmd : 0, .offs = offs};
+    int retval = shard_scan(ch->slog, channel_send_rec, &resp);
+
+    // nothing is sent for wrong seek, whole history then
+    if (retval == 0 && resp.seek){
+        resp.seek = 0;
+        retval = shard_scan(ch->slog, channel_send_rec, &resp);
+    }
+    return retval || resp.err ? -1 : 0;
+}
+
+int channel_apply(channel_t *ch, const char *data, size_t size){
+    size_t done;
+    int retval = 0;
+
+    if (ch->slog)
+        return channel_append(ch, data, size);
+
+    if (channel_lock(ch, size))
+        return -1;
+    if (backend_begin(ch->be)){
+        retval = -1;
+        goto out;
+    }
+    if ((done = channel_write(ch, data, size)) < size)
+        retval = -1;
+    if (channel_commit(ch, data, done))
+        retval = -1;
+    backend_end(ch->be);
+
+    out: channel_unlock(ch);
+    return retval;
+}
+
+int pkt_buf_append(pkt_buf_t *pkt, const char *data, size_t size){
+    char *new_data;
+    size_t new_cap = pkt->cap ? pkt->cap : PKT_BUF_MIN;
+
+    while (new_cap < pkt->size + size)
+        new_cap *= 2;
+    if (new_cap != pkt->cap){
+        if ((new_data = realloc(pkt->data, new_cap)) == NULL){
+            syslog(LOG_ERR, "%s: %m", "Error allocate packet buffer");
+            return -1;
+        }
+        pkt->data = new_data;
+        pkt->cap = new_cap;
+    }
+    memcpy(pkt->data + pkt->size, data, size);
+    pkt->size += size;
+    return 0;
+}
+
+void pkt_buf_free(pkt_buf_t *pkt){
+    free(pkt->data);
+    memset(pkt, 0, sizeof(pkt_buf_t));
+}
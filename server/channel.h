@@ -0,0 +1,150 @@
+/*
+ * channel.h
+ *
+ * Named channels of aesdsocket. Channel is selected by client with header
+ *     AESDSOCKET_CHANNEL:<name>\n
+ * sent as the first line of connection. Connections without header use
+ * default channel. Every channel has own backend and own lock, so
+ * unrelated channels don't contend.
+ * File channel with sharded log (shard.h) has no backend: packets are
+ * appended without channel lock and responses come from cache or merged
+ * shards.
+ *
+ * With scheduler (-j option) packets are received before channel lock and
+ * waiting packets get the lock shortest first: waiter with the smallest
+ * arrival time + size * cost_ns goes next. Packet waits behind smaller
+ * ones at most size * cost_ns, so big packets are not starved.
+ */
+
+#ifndef AESDSOCKET_CHANNEL_H
+#define AESDSOCKET_CHANNEL_H
+
+#include <pthread.h>
+#include "./queue.h"
+#include "./backend.h"
+#include "./cache.h"
+#include "./shard.h"
+
+#define CHANNEL_HDR "AESDSOCKET_CHANNEL:"
+#define CHANNEL_HDR_SIZE (sizeof(CHANNEL_HDR)/sizeof(char)-1)
+#define CHANNEL_NAME_MAX 32
+#define CHANNEL_DIR "/var/tmp/aesdsocket"
+#define PKT_BUF_MIN 1024
+
+/* Growable buffer for collecting committed packet */
+typedef struct pkt_buf_s pkt_buf_t;
+struct pkt_buf_s{
+    char *data;
+    size_t size;
+    size_t cap;
+};
+
+/* Packet waiting for channel lock */
+typedef struct sched_waiter_s sched_waiter_t;
+struct sched_waiter_s{
+    uint64_t key;           /* arrival + cost, ns */
+    int granted;
+    pthread_cond_t cond;
+    TAILQ_ENTRY(sched_waiter_s) next;
+};
+
+typedef struct channel_s channel_t;
+struct channel_s{
+    char name[CHANNEL_NAME_MAX + 1];    /* empty for default channel */
+    pthread_mutex_t lock;               /* serializes packets of channel */
+    backend_t *be;                      /* NULL for sharded log */
+    shard_log_t *slog;
+    cache_t *cache;                     /* NULL if responses are not cached */
+
+    /* scheduler of lock, sched_ns is 0 if off. Not used by sharded channel */
+    uint64_t sched_ns;
+    pthread_mutex_t sched_lock;
+    int sched_busy;
+    TAILQ_HEAD(, sched_waiter_s) waiters;  /* sorted by key */
+    SLIST_ENTRY(channel_s) next;
+};
+
+/*!
+ * @param default_path storage of default channel
+ * @param dir directory for files of named channels
+ * @param opts log options of file backends, NULL for defaults
+ * @param cache_budget max bytes of response cache of channel, 0 - no cache
+ * @param sched_ns aging of packet scheduler per byte, 0 - no scheduler
+ */
+int channels_init(const char *default_path, const char *dir, const wal_opts_t *opts,
+                  size_t cache_budget, uint64_t sched_ns);
+
+/*!
+ * Find channel by name, create it on first use.
+ * @param name channel name, NULL or "" for default channel
+ * @return channel or NULL (bad name or error create backend)
+ */
+channel_t *channel_get(const char *name);
+
+channel_t *channel_default(void);
+
+int channel_name_valid(const char *name);
+
+/*!
+ * Path of file in channel directory, directory is created if it doesn't exist.
+ * Names starting with '.' are not channel names, server keeps own files with them.
+ * @return 0 on success
+ */
+int channels_file(const char *file, char *path, size_t size);
+
+void channels_destroy(void);
+
+/*!
+ * Lock channel for packet, through scheduler if it is on
+ * @param cost size of packet
+ * @return 0 on success
+ */
+int channel_lock(channel_t *ch, size_t cost);
+
+void channel_unlock(channel_t *ch);
+
+/*!
+ * Write whole packet to backend, under channel lock
+ * @return bytes written
+ */
+size_t channel_write(channel_t *ch, const char *data, size_t size);
+
+/*!
+ * Packet of channel is committed (fully written to backend).
+ * Makes packet durable according to backend policy, adds it to response
+ * cache and passes it to replication. Must be called under channel lock
+ * before response. Unterminated end of packet (closed connection) is not
+ * cached or replicated if backend drops it (aesdchar).
+ * @return 0 on success
+ */
+int channel_commit(channel_t *ch, const char *data, size_t size);
+
+/*!
+ * Write packet received not from client (replication) to channel
+ * @return 0 on success
+ */
+int channel_apply(channel_t *ch, const char *data, size_t size);
+
+/*!
+ * Append packet to sharded log of channel, no channel lock needed.
+ * Returns when packet and all older ones are committed.
+ * @return 0 on success
+ */
+int channel_append(channel_t *ch, const char *data, size_t size);
+
+/*!
+ * Send response of sharded channel from merged log (not cached part)
+ * @param cmd record to start from, NULL for start of visible data
+ * @return 0 on success
+ */
+int channel_send_log(channel_t *ch, int fd, const uint32_t *cmd, uint32_t offs);
+
+/*!
+ * @return reference to current response snapshot or NULL (cache_put it)
+ */
+cache_snap_t *channel_snapshot(channel_t *ch);
+
+int pkt_buf_append(pkt_buf_t *pkt, const char *data, size_t size);
+void pkt_buf_free(pkt_buf_t *pkt);
+
+#endif /* AESDSOCKET_CHANNEL_H */
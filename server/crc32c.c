@@ -0,0 +1,142 @@
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#include "./crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78 /* reflected Castagnoli polynomial */
+
+/* crc32c_table[k][i] is crc of byte i followed by k zero bytes */
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static void crc32c_init(void);
+static uint32_t (*crc32c_impl)(uint32_t crc, const void *buf, size_t len) = crc32c_sw;
+static const char *crc32c_impl_name = "slice-by-8";
+
+static void crc32c_init_table(void){
+    uint32_t crc;
+
+    for (uint32_t i = 0; i < 256; i++){
+        crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (int k = 1; k < 8; k++)
+            crc32c_table[k][i] = (crc32c_table[k-1][i] >> 8) ^ crc32c_table[0][crc32c_table[k-1][i] & 0xff];
+}
+
+/*****************************************************
+*
+* Portable slice-by-8
+*
+*****************************************************/
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len){
+    const uint8_t *pos = buf;
+    uint64_t word;
+
+    pthread_once(&crc32c_once, crc32c_init);
+
+    crc = ~crc;
+    // align to 8 bytes
+    while (len && ((uintptr_t)pos & 7)){
+        crc = crc32c_table[0][(crc ^ *pos++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8){
+        memcpy(&word, pos, sizeof(word));
+        word = le64toh(word) ^ crc;
+        crc = crc32c_table[7][word & 0xff] ^
+              crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^
+              crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^
+              crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^
+              crc32c_table[0][word >> 56];
+        pos += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = crc32c_table[0][(crc ^ *pos++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/*****************************************************
+*
+* SSE4.2 crc32 instruction
+*
+*****************************************************/
+
+#ifdef CRC32C_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len){
+    const uint8_t *pos = buf;
+    uint64_t crc64, word;
+
+    crc = ~crc;
+    while (len && ((uintptr_t)pos & 7)){
+        crc = _mm_crc32_u8(crc, *pos++);
+        len--;
+    }
+    crc64 = crc;
+    while (len >= 8){
+        memcpy(&word, pos, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        pos += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *pos++);
+    return ~crc;
+}
+#endif
+
+uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len){
+#ifdef CRC32C_HAVE_SSE42
+    if (crc32c_hw_available())
+        return crc32c_sse42(crc, buf, len);
+#endif
+    return crc32c_sw(crc, buf, len);
+}
+
+int crc32c_hw_available(void){
+#ifdef CRC32C_HAVE_SSE42
+    return __builtin_cpu_supports("sse4.2");
+#else
+    return 0;
+#endif
+}
+
+/*****************************************************
+*
+* Runtime selection
+*
+*****************************************************/
+
+static void crc32c_init(void){
+    crc32c_init_table();
+#ifdef CRC32C_HAVE_SSE42
+    if (crc32c_hw_available()){
+        crc32c_impl = crc32c_sse42;
+        crc32c_impl_name = "sse4.2";
+    }
+#endif
+}
+
+const char *crc32c_name(void){
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_impl_name;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len){
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_impl(crc, buf, len);
+}
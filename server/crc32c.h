@@ -0,0 +1,33 @@
+/*
+ * crc32c.h
+ *
+ * CRC-32C (Castagnoli) checksum for records of storage and replication.
+ * crc32c() uses SSE4.2 crc32 instruction when CPU supports it and
+ * portable slice-by-8 tables otherwise. Selection is done on first call.
+ */
+
+#ifndef AESDSOCKET_CRC32C_H
+#define AESDSOCKET_CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*!
+ * @param crc previous value (0 for new checksum)
+ * @param buf data
+ * @param len size of data
+ * @return checksum of previous data followed by buf
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Implementations, for benchmark and tests */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len);
+int crc32c_hw_available(void);
+
+/*!
+ * @return name of implementation used by crc32c()
+ */
+const char *crc32c_name(void);
+
+#endif /* AESDSOCKET_CRC32C_H */
@@ -0,0 +1,61 @@
+/*
+ * Throughput microbenchmark of crc32c implementations.
+ * Usage: ./crc32c_bench [total MB per size]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "./crc32c.h"
+
+#define CHECK_VALUE 0xe3069283 /* crc32c("123456789") */
+
+typedef uint32_t (*crc_fn_t)(uint32_t crc, const void *buf, size_t len);
+
+static double now_s(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench(crc_fn_t fn, const char *buf, size_t size, size_t total, uint32_t *crc){
+    size_t iterations = total / size + 1;
+    double start = now_s();
+
+    *crc = 0;
+    for (size_t i = 0; i < iterations; i++)
+        *crc = fn(*crc, buf, size);
+    return (double)iterations * size / (now_s() - start) / (1024 * 1024);
+}
+
+int main(int argc, char *argv[]){
+    const size_t sizes[] = {16, 64, 1024, 16 * 1024, 1024 * 1024};
+    size_t total = (argc > 1 ? atoi(argv[1]) : 256) * 1024 * 1024;
+    uint32_t crc_sw, crc_hw;
+    char *buf;
+
+    if (crc32c_sw(0, "123456789", 9) != CHECK_VALUE ||
+        crc32c_hw(0, "123456789", 9) != CHECK_VALUE){
+        printf("Check value mismatch\n");
+        return 1;
+    }
+
+    if ((buf = malloc(sizes[sizeof(sizes)/sizeof(sizes[0]) - 1] + 1)) == NULL)
+        return 1;
+    srand(1);
+    for (size_t i = 0; i <= sizes[sizeof(sizes)/sizeof(sizes[0]) - 1]; i++)
+        buf[i] = rand();
+
+    printf("crc32c uses %s, hardware %savailable\n", crc32c_name(), crc32c_hw_available() ? "" : "not ");
+    printf("%10s %14s %14s\n", "size", "sw MB/s", "hw MB/s");
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+        // +1 for unaligned start
+        double sw = bench(crc32c_sw, buf + 1, sizes[i], total, &crc_sw);
+        double hw = bench(crc32c_hw, buf + 1, sizes[i], total, &crc_hw);
+        printf("%10zu %14.1f %14.1f%s\n", sizes[i], sw, hw, crc_sw == crc_hw ? "" : " MISMATCH");
+        if (crc_sw != crc_hw)
+            return 1;
+    }
+    free(buf);
+    return 0;
+}
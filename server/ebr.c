@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "./ebr.h"
+#include "./metrics.h"
+
+/* Reader record, one per thread, reused after thread exit */
+typedef struct ebr_rec_s ebr_rec_t;
+struct ebr_rec_s{
+    int in_use;
+    int active;
+    uint64_t epoch;
+    ebr_rec_t *next;
+};
+
+/* Retired object */
+typedef struct ebr_item_s ebr_item_t;
+struct ebr_item_s{
+    void *ptr;
+    ebr_free_t fn;
+    uint64_t epoch;
+    ebr_item_t *next;
+};
+
+static uint64_t ebr_epoch = 0;
+static ebr_rec_t *ebr_recs = NULL;
+
+// retired objects in epoch order
+static pthread_mutex_t ebr_lock = PTHREAD_MUTEX_INITIALIZER;
+static ebr_item_t *ebr_head = NULL, *ebr_tail = NULL;
+static long ebr_pending = 0;
+
+static pthread_once_t ebr_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ebr_key;
+static __thread ebr_rec_t *ebr_self = NULL;
+
+/*****************************************************
+*
+* Readers
+*
+*****************************************************/
+
+static void ebr_thread_exit(void *arg){
+    ebr_rec_t *rec = arg;
+
+    __atomic_store_n(&rec->active, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void ebr_init(void){
+    if (pthread_key_create(&ebr_key, ebr_thread_exit) != 0)
+        syslog(LOG_ERR, "%s: %m", "Error create epoch key");
+}
+
+static ebr_rec_t *ebr_rec_get(void){
+    ebr_rec_t *rec;
+    int free_rec = 0;
+
+    if (ebr_self)
+        return ebr_self;
+    pthread_once(&ebr_once, ebr_init);
+
+    // reuse record of finished thread
+    for (rec = __atomic_load_n(&ebr_recs, __ATOMIC_ACQUIRE); rec; rec = rec->next)
+        if (!__atomic_load_n(&rec->in_use, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&rec->in_use, &free_rec, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+        else
+            free_rec = 0;
+
+    if (rec == NULL){
+        // records are never freed, their number is max number of threads
+        if ((rec = calloc(1, sizeof(ebr_rec_t))) == NULL){
+            syslog(LOG_ERR, "%s: %m", "Error allocate epoch record");
+            abort();
+        }
+        rec->in_use = 1;
+        rec->next = __atomic_load_n(&ebr_recs, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&ebr_recs, &rec->next, rec, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(ebr_key, rec);
+    ebr_self = rec;
+    return rec;
+}
+
+void ebr_enter(void){
+    ebr_rec_t *rec = ebr_rec_get();
+
+    __atomic_store_n(&rec->epoch, __atomic_load_n(&ebr_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->active, 1, __ATOMIC_RELAXED);
+    // section reads shared pointer only after it is announced
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void ebr_exit(void){
+    __atomic_store_n(&ebr_self->active, 0, __ATOMIC_RELEASE);
+}
+
+/*****************************************************
+*
+* Writers
+*
+*****************************************************/
+
+void ebr_retire(void *ptr, ebr_free_t fn){
+    ebr_item_t *item = malloc(sizeof(ebr_item_t));
+
+    if (item == NULL){
+        // can't wait for readers, leak is better than use after free
+        syslog(LOG_ERR, "%s: %m", "Error retire object");
+        return;
+    }
+    item->ptr = ptr;
+    item->fn = fn;
+    item->next = NULL;
+
+    pthread_mutex_lock(&ebr_lock);
+    item->epoch = __atomic_load_n(&ebr_epoch, __ATOMIC_SEQ_CST);
+    if (ebr_tail)
+        ebr_tail->next = item;
+    else
+        ebr_head = item;
+    ebr_tail = item;
+    metric_set(metric_cached("ebr_pending"), ++ebr_pending);
+    pthread_mutex_unlock(&ebr_lock);
+}
+
+/*!
+ * Free items retired before epoch - 1
+ */
+static void ebr_free_until(uint64_t epoch, int all){
+    ebr_item_t *item;
+
+    while ((item = ebr_head) != NULL && (all || item->epoch + 2 <= epoch)){
+        ebr_head = item->next;
+        if (ebr_head == NULL)
+            ebr_tail = NULL;
+        item->fn(item->ptr);
+        free(item);
+        ebr_pending--;
+    }
+    metric_set(metric_cached("ebr_pending"), ebr_pending);
+}
+
+void ebr_reclaim(void){
+    uint64_t epoch;
+    ebr_rec_t *rec;
+
+    pthread_mutex_lock(&ebr_lock);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    epoch = __atomic_load_n(&ebr_epoch, __ATOMIC_RELAXED);
+    for (rec = __atomic_load_n(&ebr_recs, __ATOMIC_ACQUIRE); rec; rec = rec->next)
+        if (__atomic_load_n(&rec->active, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&rec->epoch, __ATOMIC_RELAXED) != epoch)
+            break;
+    if (rec == NULL){
+        __atomic_store_n(&ebr_epoch, ++epoch, __ATOMIC_SEQ_CST);
+        metric_set(metric_cached("ebr_epoch"), epoch);
+    }
+    ebr_free_until(epoch, 0);
+    pthread_mutex_unlock(&ebr_lock);
+}
+
+void ebr_drain(void){
+    pthread_mutex_lock(&ebr_lock);
+    ebr_free_until(0, 1);
+    pthread_mutex_unlock(&ebr_lock);
+}
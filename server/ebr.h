@@ -0,0 +1,38 @@
+/*
+ * ebr.h
+ *
+ * Epoch based reclamation of shared objects.
+ * Reader accesses shared pointer inside ebr_enter()/ebr_exit() without
+ * locks. Writer replaces the pointer and retires old object; it is freed
+ * when global epoch advanced twice after retire, then no reader which
+ * could see the old pointer is inside its section any more.
+ * Reader sections must be short (no I/O) and not nested: reader keeps
+ * object for longer by taking its own reference inside the section.
+ */
+
+#ifndef AESDSOCKET_EBR_H
+#define AESDSOCKET_EBR_H
+
+#include <stdint.h>
+
+typedef void (*ebr_free_t)(void *ptr);
+
+void ebr_enter(void);
+void ebr_exit(void);
+
+/*!
+ * Free ptr with fn when no reader can hold it
+ */
+void ebr_retire(void *ptr, ebr_free_t fn);
+
+/*!
+ * Advance epoch if all readers are in current one and free what is safe
+ */
+void ebr_reclaim(void);
+
+/*!
+ * Free all retired objects. Only when there are no readers (shutdown).
+ */
+void ebr_drain(void);
+
+#endif /* AESDSOCKET_EBR_H */
@@ -0,0 +1,67 @@
+#!/bin/bash
+# Memory footprint test: hold many idle connections to aesdsocket with
+# small client thread stacks and check RSS per connection from metrics.
+# Usage: ./idle-test.sh [connections [budget bytes per connection [path to aesdsocket]]]
+
+CONNECTIONS=${1:-10000}
+BUDGET=${2:-16384}
+AESDSOCKET=${3:-$(dirname $(realpath $0))/aesdsocket}
+PORT=9020
+STACK_KB=${STACK_KB:-64}     # 0 - default stack size
+WORKDIR=$(mktemp -d)
+
+cleanup() {
+    kill $server_pid 2>/dev/null
+    wait 2>/dev/null
+    rm -rf ${WORKDIR}
+}
+trap cleanup EXIT
+
+# metric value from metrics file
+metric() {
+    awk -v name=$1 '$1 == name {print $2}' ${WORKDIR}/metrics
+}
+
+# server and this shell hold one descriptor per connection
+ulimit -n $((CONNECTIONS + 256)) || exit 1
+
+stack_opt=""
+[ "${STACK_KB}" != "0" ] && stack_opt="-t ${STACK_KB}"
+${AESDSOCKET} -q -p ${PORT} -f ${WORKDIR}/data -D ${WORKDIR}/channels \
+    ${stack_opt} -m ${WORKDIR}/metrics &
+server_pid=$!
+sleep 0.5
+
+fds=()
+for i in $(seq 1 ${CONNECTIONS}); do
+    exec {fd}<>/dev/tcp/127.0.0.1/${PORT} || { echo "Connection ${i} failed"; exit 1; }
+    fds+=(${fd})
+done
+
+# metrics are dumped every second
+for i in $(seq 1 30); do
+    sleep 1
+    [ "$(metric connections)" == "${CONNECTIONS}" ] && break
+done
+sleep 1.5
+connections=$(metric connections)
+rss_kb=$(metric rss_kb)
+vm_kb=$(metric vm_kb)
+per_connection=$(metric rss_per_connection_b)
+
+echo "connections ${connections} vm_kb ${vm_kb} rss_kb ${rss_kb} rss_per_connection_b ${per_connection}" \
+    "(budget ${BUDGET}, stack ${STACK_KB} kB)"
+
+for fd in ${fds[@]}; do
+    exec {fd}<&-
+done
+
+if [ "${connections}" != "${CONNECTIONS}" ]; then
+    echo "Idle connection test failed: not all connections served"
+    exit 1
+fi
+if [ -z "${per_connection}" ] || [ ${per_connection} -gt ${BUDGET} ]; then
+    echo "Idle connection test failed: memory per connection over budget"
+    exit 1
+fi
+echo "Idle connection test passed"
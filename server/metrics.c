@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include "./metrics.h"
+
+static metric_t metrics[METRICS_MAX];
+static metric_t dummy = {"dummy", 0};
+static int metrics_count = 0;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char metrics_path[PATH_MAX];
+static unsigned metrics_interval_ms = METRICS_INTERVAL_MS;
+static long rss_base_kb = 0;
+
+metric_t *metric_get(const char *name){
+    metric_t *m = &dummy;
+
+    pthread_mutex_lock(&metrics_lock);
+    for (int i = 0; i < metrics_count; i++)
+        if (strcmp(metrics[i].name, name) == 0){
+            m = &metrics[i];
+            goto out;
+        }
+    if (metrics_count < METRICS_MAX){
+        m = &metrics[metrics_count++];
+        m->name = name;
+        m->value = 0;
+    }
+    else
+        syslog(LOG_ERR, "No room for metric %s", name);
+
+    out: pthread_mutex_unlock(&metrics_lock);
+    return m;
+}
+
+/*!
+ * @param vm_kb virtual memory of process in kB, may be NULL
+ * @return resident memory of process in kB or -1
+ */
+static long metrics_rss_kb(long *vm_kb){
+    long size, resident = -1;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f == NULL)
+        return -1;
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+        resident = -1;
+    fclose(f);
+    if (vm_kb)
+        *vm_kb = size * (sysconf(_SC_PAGESIZE) / 1024);
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*!
+ * Memory footprint: virtual size, RSS and RSS growth since start per open connection
+ */
+static void metrics_footprint(void){
+    long vm_kb, rss_kb = metrics_rss_kb(&vm_kb);
+    long conns = metric_value(metric_cached("connections"));
+
+    if (rss_kb < 0)
+        return;
+    metric_set(metric_cached("vm_kb"), vm_kb);
+    metric_set(metric_cached("rss_kb"), rss_kb);
+    metric_set(metric_cached("rss_per_connection_b"),
+               conns > 0 && rss_kb > rss_base_kb ? (rss_kb - rss_base_kb) * 1024 / conns : 0);
+}
+
+/*!
+ * Write all metrics to temporary file and rename it, so reader never sees partial dump
+ */
+int metrics_dump(const char *path){
+    char tmp_path[PATH_MAX + 8];
+    FILE *f;
+    int count;
+
+    metrics_footprint();
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    if ((f = fopen(tmp_path, "w")) == NULL){
+        syslog(LOG_ERR, "%s %s: %m", "Error open metrics file", tmp_path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&metrics_lock);
+    count = metrics_count;
+    pthread_mutex_unlock(&metrics_lock);
+
+    for (int i = 0; i < count; i++)
+        fprintf(f, "%s %ld\n", metrics[i].name, metric_value(&metrics[i]));
+
+    if (fclose(f) == EOF || rename(tmp_path, path) == -1){
+        syslog(LOG_ERR, "%s %s: %m", "Error write metrics file", path);
+        return -1;
+    }
+    return 0;
+}
+
+static void *metrics_thread(void *arg){
+    struct timespec ts = {
+        .tv_sec = metrics_interval_ms / 1000,
+        .tv_nsec = (metrics_interval_ms % 1000) * 1000000L,
+    };
+
+    while (1){
+        metrics_dump(metrics_path);
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+int metrics_start(const char *path, unsigned interval_ms){
+    pthread_t thread;
+
+    if (strlen(path) >= sizeof(metrics_path)){
+        syslog(LOG_ERR, "Metrics path too long %s", path);
+        return -1;
+    }
+    strcpy(metrics_path, path);
+    if (interval_ms)
+        metrics_interval_ms = interval_ms;
+    // connections are counted against memory of started server
+    rss_base_kb = metrics_rss_kb(NULL);
+
+    if (pthread_create(&thread, NULL, metrics_thread, NULL) != 0){
+        syslog(LOG_ERR, "%s: %m", "Error create metrics thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
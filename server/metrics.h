@@ -0,0 +1,54 @@
+/*
+ * metrics.h
+ *
+ * Named counters/gauges of aesdsocket. Values are dumped periodically
+ * to text file as "name value" lines (-m option).
+ * Dump adds memory footprint: vm_kb, rss_kb and rss_per_connection_b, growth of
+ * RSS since metrics start divided by "connections" gauge.
+ */
+
+#ifndef AESDSOCKET_METRICS_H
+#define AESDSOCKET_METRICS_H
+
+#define METRICS_MAX 64
+#define METRICS_INTERVAL_MS 1000
+
+typedef struct metric_s metric_t;
+struct metric_s{
+    const char *name;
+    long value;
+};
+
+/*!
+ * Register metric. Registering the same name twice returns the same metric.
+ * @param name static string
+ * @return metric, never NULL (dummy metric when table is full)
+ */
+metric_t *metric_get(const char *name);
+
+/*!
+ * Metric of name looked up once per call site, hot paths don't take metrics lock.
+ * Threads racing on the first use store the same metric.
+ * @param name string literal
+ */
+#define metric_cached(name) ({ \
+        static metric_t *metric_; \
+        metric_t *m_ = __atomic_load_n(&metric_, __ATOMIC_ACQUIRE); \
+        if (m_ == NULL){ \
+            m_ = metric_get(name); \
+            __atomic_store_n(&metric_, m_, __ATOMIC_RELEASE); \
+        } \
+        m_; })
+
+#define metric_set(m, v) __atomic_store_n(&(m)->value, (long)(v), __ATOMIC_RELAXED)
+#define metric_add(m, v) __atomic_add_fetch(&(m)->value, (long)(v), __ATOMIC_RELAXED)
+#define metric_value(m) __atomic_load_n(&(m)->value, __ATOMIC_RELAXED)
+
+/*!
+ * Start thread which rewrites path with current values every interval
+ */
+int metrics_start(const char *path, unsigned interval_ms);
+
+int metrics_dump(const char *path);
+
+#endif /* AESDSOCKET_METRICS_H */
@@ -0,0 +1,98 @@
+#!/bin/bash
+# Replication test on loopback: primary and follower aesdsocket in one box.
+# Packets are sent to primary, follower must return the same data.
+# Usage: ./repl-test.sh [path to aesdsocket]
+
+AESDSOCKET=${1:-$(dirname $(realpath $0))/aesdsocket}
+PRIMARY_PORT=9010
+FOLLOWER_PORT=9011
+REPL_PORT=9012
+WORKDIR=$(mktemp -d)
+
+# send packet to port, print response
+send_packet() {
+    exec 3<>/dev/tcp/127.0.0.1/$1 || return 1
+    printf "$2" >&3
+    timeout 1 cat <&3
+    exec 3<&-
+}
+
+cleanup() {
+    kill $primary_pid $follower_pid 2>/dev/null
+    wait 2>/dev/null
+    rm -rf ${WORKDIR}
+}
+trap cleanup EXIT
+
+${AESDSOCKET} -p ${PRIMARY_PORT} -f ${WORKDIR}/primary.data -D ${WORKDIR}/primary \
+    -R ${REPL_PORT} -m ${WORKDIR}/primary.metrics &
+primary_pid=$!
+sleep 0.5
+${AESDSOCKET} -p ${FOLLOWER_PORT} -f ${WORKDIR}/follower.data -D ${WORKDIR}/follower \
+    -F 127.0.0.1:${REPL_PORT} -m ${WORKDIR}/follower.metrics &
+follower_pid=$!
+sleep 0.5
+
+for i in $(seq 1 10); do
+    send_packet ${PRIMARY_PORT} "packet${i}\n" > /dev/null
+done
+expected=$(send_packet ${PRIMARY_PORT} "AESDCHAR_IOCSEEKTO:0,0\n")
+sleep 2
+
+actual=$(send_packet ${FOLLOWER_PORT} "AESDCHAR_IOCSEEKTO:0,0\n")
+
+echo "Follower metrics:"
+cat ${WORKDIR}/follower.metrics
+
+if [ "${expected}" != "${actual}" ]; then
+    echo "Replication test failed"
+    echo "expected: ${expected}"
+    echo "actual:   ${actual}"
+    exit 1
+fi
+
+# primary restarts and publishes new packets before follower reconnects,
+# follower must not continue old seqs in the new log (more packets than follower applied)
+kill -STOP $follower_pid
+kill $primary_pid
+wait $primary_pid 2>/dev/null
+${AESDSOCKET} -p ${PRIMARY_PORT} -f ${WORKDIR}/primary.data -D ${WORKDIR}/primary \
+    -R ${REPL_PORT} -m ${WORKDIR}/primary.metrics &
+primary_pid=$!
+sleep 0.5
+for i in $(seq 1 12); do
+    send_packet ${PRIMARY_PORT} "restarted${i}\n" > /dev/null
+done
+kill -CONT $follower_pid
+expected=$(send_packet ${PRIMARY_PORT} "AESDCHAR_IOCSEEKTO:0,0\n")
+sleep 3
+
+actual=$(send_packet ${FOLLOWER_PORT} "AESDCHAR_IOCSEEKTO:0,0\n")
+if [ "${expected}" != "${actual}" ]; then
+    echo "Replication test after primary restart failed"
+    echo "expected: ${expected}"
+    echo "actual:   ${actual}"
+    exit 1
+fi
+
+# follower restarts, it continues from saved position and doesn't apply
+# packets of primary log twice
+kill $follower_pid
+wait $follower_pid 2>/dev/null
+for i in $(seq 1 3); do
+    send_packet ${PRIMARY_PORT} "after_follower${i}\n" > /dev/null
+done
+${AESDSOCKET} -p ${FOLLOWER_PORT} -f ${WORKDIR}/follower.data -D ${WORKDIR}/follower \
+    -F 127.0.0.1:${REPL_PORT} -m ${WORKDIR}/follower.metrics &
+follower_pid=$!
+expected=$(send_packet ${PRIMARY_PORT} "AESDCHAR_IOCSEEKTO:0,0\n")
+sleep 3
+
+actual=$(send_packet ${FOLLOWER_PORT} "AESDCHAR_IOCSEEKTO:0,0\n")
+if [ "${expected}" != "${actual}" ]; then
+    echo "Replication test after follower restart failed"
+    echo "expected: ${expected}"
+    echo "actual:   ${actual}"
+    exit 1
+fi
+echo "Replication test passed"
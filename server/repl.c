@@ -0,0 +1,690 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <endian.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "./repl.h"
+#include "./channel.h"
+#include "./metrics.h"
+#include "./crc32c.h"
+
+typedef struct repl_entry_s repl_entry_t;
+struct repl_entry_s{
+    uint64_t seq;
+    uint64_t ts_ns;
+    size_t size;
+    uint16_t name_size;
+    char data[];        /* name followed by packet */
+};
+
+/* Sender thread of one follower */
+typedef struct repl_sender_s repl_sender_t;
+struct repl_sender_s{
+    int fd;
+    repl_sender_t *next;
+};
+
+/* Replication log of primary. Ring is indexed by seq */
+static struct {
+    int started;
+    uint64_t log_id;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    repl_entry_t *log[REPL_LOG_RECORDS];
+    uint64_t first_seq;     /* oldest record in log */
+    uint64_t head_seq;      /* last published record, 0 if nothing published */
+    size_t bytes;
+    int server_fd;
+    pthread_t acceptor;
+    int senders;                /* sender threads, created or running */
+    repl_sender_t *sender_list; /* running senders, their fds are shut down by stop */
+} primary = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .first_seq = 1,
+    .server_fd = -1,
+};
+
+/* Position of follower in state file */
+struct repl_state{
+    uint32_t magic;
+    uint32_t crc;           /* crc32c of log_id and applied_seq */
+    uint64_t log_id;
+    uint64_t applied_seq;
+} __attribute__((packed));
+
+/* Follower thread, fd of primary connection is shut down by stop */
+static struct {
+    int started;
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int fd;
+    int state_fd;
+    uint64_t log_id;        /* position loaded from state file */
+    uint64_t applied_seq;
+} follower = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .fd = -1,
+    .state_fd = -1,
+};
+
+static char follower_host[NI_MAXHOST];
+static char follower_port[NI_MAXSERV];
+
+static int stopping;
+
+#define REPL_SLOT(seq) ((seq) & (REPL_LOG_RECORDS - 1))
+
+/* Acknowledge being received by sender */
+typedef struct repl_ack_buf_s repl_ack_buf_t;
+struct repl_ack_buf_s{
+    struct repl_ack ack;
+    size_t size;
+};
+
+/*****************************************************
+*
+* Service Functions
+*
+*****************************************************/
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int send_all(int fd, const void *buf, size_t count){
+    const char *pos = buf;
+    ssize_t n;
+
+    while (count){
+        if ((n = send(fd, pos, count, MSG_NOSIGNAL)) < 0){
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        pos += n;
+        count -= n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t count){
+    char *pos = buf;
+    ssize_t n;
+
+    while (count){
+        if ((n = recv(fd, pos, count, 0)) <= 0){
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        pos += n;
+        count -= n;
+    }
+    return 0;
+}
+
+/*****************************************************
+*
+* Primary
+*
+*****************************************************/
+
+static void repl_evict(void){
+    repl_entry_t *e = primary.log[REPL_SLOT(primary.first_seq)];
+
+    primary.log[REPL_SLOT(primary.first_seq)] = NULL;
+    primary.bytes -= e->size;
+    primary.first_seq++;
+    free(e);
+}
+
+void repl_publish(const char *channel, const char *data, size_t size){
+    size_t name_size = strlen(channel);
+    repl_entry_t *e;
+
+    if (!primary.started)
+        return;
+
+    if ((e = malloc(sizeof(repl_entry_t) + name_size + size)) == NULL){
+        syslog(LOG_ERR, "%s: %m", "Error allocate replication record");
+        return;
+    }
+    e->ts_ns = now_ns();
+    e->size = size;
+    e->name_size = name_size;
+    memcpy(e->data, channel, name_size);
+    memcpy(e->data + name_size, data, size);
+
+    pthread_mutex_lock(&primary.lock);
+    while (primary.first_seq <= primary.head_seq &&
+            (primary.head_seq - primary.first_seq + 1 >= REPL_LOG_RECORDS ||
+             primary.bytes + size > REPL_LOG_BYTES))
+        repl_evict();
+
+    e->seq = ++primary.head_seq;
+    primary.log[REPL_SLOT(e->seq)] = e;
+    primary.bytes += size;
+    pthread_cond_broadcast(&primary.cond);
+    pthread_mutex_unlock(&primary.lock);
+
+    metric_set(metric_cached("repl_head_seq"), e->seq);
+}
+
+/*!
+ * Copy records from *next_seq to batch and advance *next_seq. Must be called under primary lock.
+ * @return 0 on success, -1 if no record fits to batch
+ */
+static int repl_fill_batch(pkt_buf_t *batch, uint64_t *next_seq){
+    struct repl_batch hdr;
+    struct repl_rec rec;
+    repl_entry_t *e;
+    uint32_t count = 0;
+    size_t size;
+
+    batch->size = 0;
+    if (pkt_buf_append(batch, (char *)&hdr, sizeof(hdr)))
+        return -1;
+
+    while (*next_seq <= primary.head_seq &&
+            (count == 0 || batch->size < REPL_BATCH_BYTES)){
+        e = primary.log[REPL_SLOT(*next_seq)];
+        rec.seq = htole64(e->seq);
+        rec.ts_ns = htole64(e->ts_ns);
+        rec.size = htole32(e->size);
+        rec.name_size = htole16(e->name_size);
+        rec.pad = 0;
+        size = batch->size;
+        if (pkt_buf_append(batch, (char *)&rec, sizeof(rec)) ||
+            pkt_buf_append(batch, e->data, e->name_size + e->size)){
+            // record without its data is not sent
+            batch->size = size;
+            break;
+        }
+        count++;
+        (*next_seq)++;
+    }
+
+    if (!count)
+        return -1;
+
+    hdr.magic = htole32(REPL_MAGIC);
+    hdr.count = htole32(count);
+    hdr.log_id = htole64(primary.log_id);
+    hdr.head_seq = htole64(primary.head_seq);
+    hdr.size = htole32(batch->size - sizeof(hdr));
+    hdr.crc = htole32(crc32c(0, batch->data + sizeof(hdr), batch->size - sizeof(hdr)));
+    memcpy(batch->data, &hdr, sizeof(hdr));
+    return 0;
+}
+
+/*!
+ * Collect acknowledges of follower without waiting. Part of ack stays in ack buffer
+ * until the rest of it comes.
+ * @return 0 on success, -1 if follower disconnected
+ */
+static int repl_recv_acks(int fd, repl_ack_buf_t *acks){
+    ssize_t n;
+
+    while ((n = recv(fd, (char *)&acks->ack + acks->size, sizeof(acks->ack) - acks->size,
+                     MSG_DONTWAIT)) > 0){
+        acks->size += n;
+        if (acks->size < sizeof(acks->ack))
+            continue;
+        acks->size = 0;
+        if (le32toh(acks->ack.magic) == REPL_MAGIC)
+            metric_set(metric_cached("repl_acked_seq"), le64toh(acks->ack.applied_seq));
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    syslog(LOG_DEBUG, "%s", "Follower disconnected");
+    return -1;
+}
+
+static void *repl_sender(void *arg){
+    int fd = (int)(intptr_t)arg;
+    repl_sender_t self = {.fd = fd}, **pos;
+    struct repl_hello hello;
+    struct timespec deadline;
+    pkt_buf_t batch = {0};
+    repl_ack_buf_t acks = {0};
+    uint64_t next_seq;
+    metric_t *followers = metric_cached("repl_followers");
+
+    pthread_mutex_lock(&primary.lock);
+    if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)){
+        pthread_mutex_unlock(&primary.lock);
+        goto done;
+    }
+    self.next = primary.sender_list;
+    primary.sender_list = &self;
+    pthread_mutex_unlock(&primary.lock);
+
+    metric_add(followers, 1);
+    if (recv_all(fd, &hello, sizeof(hello)) ||
+            le32toh(hello.magic) != REPL_MAGIC || le32toh(hello.version) != REPL_VERSION){
+        syslog(LOG_ERR, "%s", "Wrong replication hello");
+        goto out;
+    }
+    next_seq = le64toh(hello.next_seq);
+    // seqs of restarted primary are reused, follower of previous run starts from oldest
+    if (le64toh(hello.log_id) != primary.log_id){
+        if (hello.log_id)
+            syslog(LOG_WARNING, "Follower seq %llu is of other primary log", (unsigned long long)next_seq);
+        pthread_mutex_lock(&primary.lock);
+        next_seq = primary.first_seq;
+        pthread_mutex_unlock(&primary.lock);
+    }
+    syslog(LOG_DEBUG, "Follower connected from seq %llu", (unsigned long long)next_seq);
+
+    while (1){
+        pthread_mutex_lock(&primary.lock);
+        // follower too far behind, start from oldest
+        if (next_seq > primary.head_seq + 1 || next_seq < primary.first_seq){
+            syslog(LOG_WARNING, "Follower seq %llu out of log [%llu, %llu]",
+                    (unsigned long long)next_seq, (unsigned long long)primary.first_seq,
+                    (unsigned long long)primary.head_seq);
+            next_seq = primary.first_seq;
+        }
+        while (next_seq > primary.head_seq && !__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)){
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += REPL_ACK_POLL_S;
+            pthread_cond_timedwait(&primary.cond, &primary.lock, &deadline);
+            // idle follower is checked every poll period
+            if (repl_recv_acks(fd, &acks)){
+                pthread_mutex_unlock(&primary.lock);
+                goto out;
+            }
+        }
+        if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)){
+            pthread_mutex_unlock(&primary.lock);
+            break;
+        }
+        if (next_seq < primary.first_seq)
+            next_seq = primary.first_seq;
+        if (repl_fill_batch(&batch, &next_seq)){
+            pthread_mutex_unlock(&primary.lock);
+            syslog(LOG_ERR, "%s", "Error fill replication batch");
+            break;
+        }
+        pthread_mutex_unlock(&primary.lock);
+
+        if (send_all(fd, batch.data, batch.size)){
+            syslog(LOG_ERR, "%s: %m", "Error send replication batch");
+            break;
+        }
+
+        if (repl_recv_acks(fd, &acks))
+            break;
+    }
+
+    out: metric_add(followers, -1);
+    pthread_mutex_lock(&primary.lock);
+    for (pos = &primary.sender_list; *pos != &self; pos = &(*pos)->next)
+        ;
+    *pos = self.next;
+    pthread_mutex_unlock(&primary.lock);
+
+    done: pkt_buf_free(&batch);
+    close(fd);
+    // stop waits for count of senders, nothing is touched after it
+    pthread_mutex_lock(&primary.lock);
+    primary.senders--;
+    pthread_cond_broadcast(&primary.cond);
+    pthread_mutex_unlock(&primary.lock);
+    return NULL;
+}
+
+static void *repl_acceptor(void *arg){
+    pthread_t thread;
+    int fd;
+
+    while (1){
+        if ((fd = accept(primary.server_fd, NULL, NULL)) < 0){
+            // stop shuts down listening socket
+            if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST))
+                break;
+            syslog(LOG_ERR, "%s: %m", "Accept follower failed");
+            continue;
+        }
+        pthread_mutex_lock(&primary.lock);
+        primary.senders++;
+        pthread_mutex_unlock(&primary.lock);
+        if (pthread_create(&thread, NULL, repl_sender, (void *)(intptr_t)fd) != 0){
+            syslog(LOG_ERR, "%s: %m", "Error create replication thread");
+            pthread_mutex_lock(&primary.lock);
+            primary.senders--;
+            pthread_mutex_unlock(&primary.lock);
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+int repl_primary_start(int port){
+    struct sockaddr_in addr;
+    int opt = 1;
+
+    if ((primary.server_fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0)) == -1){
+        syslog(LOG_ERR, "%s: %m", "Failed to create replication socket");
+        return -1;
+    }
+    setsockopt(primary.server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(primary.server_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(primary.server_fd, 1) == -1){
+        syslog(LOG_ERR, "%s: %m", "Failed to listen replication port");
+        goto err;
+    }
+
+    primary.log_id = now_ns() ^ getpid();
+    primary.started = 1;
+    if (pthread_create(&primary.acceptor, NULL, repl_acceptor, NULL) != 0){
+        syslog(LOG_ERR, "%s: %m", "Error create replication thread");
+        primary.started = 0;
+        goto err;
+    }
+    return 0;
+
+    err: close(primary.server_fd);
+    primary.server_fd = -1;
+    return -1;
+}
+
+/*****************************************************
+*
+* Follower
+*
+*****************************************************/
+
+static int connect_primary(void){
+    struct addrinfo hints, *res, *ai;
+    struct timeval tv = {.tv_sec = REPL_CONNECT_S};
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(follower_host, follower_port, &hints, &res) != 0){
+        syslog(LOG_ERR, "Can't resolve primary %s", follower_host);
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next){
+        if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) < 0)
+            continue;
+        // connect is limited by send timeout, so stop doesn't wait for unreachable primary
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0){
+            tv.tv_sec = 0;
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/*!
+ * Open state file and load position of follower, position of missing or
+ * broken state is 0 (everything is applied again)
+ * @return 0 on success
+ */
+static int repl_state_open(void){
+    char path[PATH_MAX];
+    struct repl_state st;
+
+    if (channels_file(REPL_STATE_FILE, path, sizeof(path)))
+        return -1;
+    if ((follower.state_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1){
+        syslog(LOG_ERR, "%s %s: %m", "Error open replication state", path);
+        return -1;
+    }
+    if (pread(follower.state_fd, &st, sizeof(st), 0) == sizeof(st) &&
+            le32toh(st.magic) == REPL_MAGIC &&
+            le32toh(st.crc) == crc32c(0, &st.log_id, sizeof(st) - offsetof(struct repl_state, log_id))){
+        follower.log_id = le64toh(st.log_id);
+        follower.applied_seq = le64toh(st.applied_seq);
+        syslog(LOG_DEBUG, "Follower continues from seq %llu", (unsigned long long)follower.applied_seq);
+    }
+    return 0;
+}
+
+/*!
+ * Save position of follower, batch is applied already
+ * @return 0 on success
+ */
+static int repl_state_save(uint64_t log_id, uint64_t applied_seq){
+    struct repl_state st;
+
+    st.magic = htole32(REPL_MAGIC);
+    st.log_id = htole64(log_id);
+    st.applied_seq = htole64(applied_seq);
+    st.crc = htole32(crc32c(0, &st.log_id, sizeof(st) - offsetof(struct repl_state, log_id)));
+    if (pwrite(follower.state_fd, &st, sizeof(st), 0) != sizeof(st) ||
+            fdatasync(follower.state_fd)){
+        syslog(LOG_ERR, "%s: %m", "Error save replication state");
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * Apply records of one batch. Stops at record which is not applied,
+ * applied_seq is seq of the last applied record.
+ * @return 0 on success, -1 if batch is malformed or record is not applied
+ */
+static int repl_apply_batch(const char *data, size_t size, uint32_t count, uint64_t *applied_seq){
+    const char *pos = data, *end = data + size;
+    char name[CHANNEL_NAME_MAX + 1];
+    struct repl_rec rec;
+    channel_t *ch;
+    size_t rec_size, name_size;
+    uint64_t ts_ns;
+
+    while (count--){
+        if (pos + sizeof(rec) > end)
+            goto malformed;
+        memcpy(&rec, pos, sizeof(rec));
+        pos += sizeof(rec);
+        rec_size = le32toh(rec.size);
+        name_size = le16toh(rec.name_size);
+        if (name_size > CHANNEL_NAME_MAX || pos + name_size + rec_size > end)
+            goto malformed;
+        memcpy(name, pos, name_size);
+        name[name_size] = '\0';
+        pos += name_size;
+
+        // record is not acked, primary sends it again after reconnect
+        if ((ch = channel_get(name)) == NULL || channel_apply(ch, pos, rec_size)){
+            syslog(LOG_ERR, "Error apply record %llu to channel '%s'",
+                   (unsigned long long)le64toh(rec.seq), name);
+            return -1;
+        }
+        pos += rec_size;
+
+        *applied_seq = le64toh(rec.seq);
+        ts_ns = le64toh(rec.ts_ns);
+        metric_set(metric_cached("repl_applied_seq"), *applied_seq);
+        metric_set(metric_cached("repl_lag_ms"), (long)((int64_t)(now_ns() - ts_ns) / 1000000));
+    }
+    return 0;
+
+    malformed: syslog(LOG_ERR, "%s", "Malformed replication batch");
+    return -1;
+}
+
+static void *repl_follower(void *arg){
+    struct repl_hello hello;
+    struct repl_batch batch;
+    struct repl_ack ack;
+    pkt_buf_t payload = {0};
+    uint64_t applied_seq = follower.applied_seq, log_id = follower.log_id, head_seq;
+    uint32_t size;
+    char *data;
+    int fd, err;
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)){
+        if ((fd = connect_primary()) < 0){
+            sleep(REPL_RETRY_S);
+            continue;
+        }
+        pthread_mutex_lock(&follower.lock);
+        if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)){
+            pthread_mutex_unlock(&follower.lock);
+            close(fd);
+            break;
+        }
+        follower.fd = fd;
+        pthread_mutex_unlock(&follower.lock);
+        syslog(LOG_DEBUG, "Connected to primary %s:%s", follower_host, follower_port);
+        metric_set(metric_cached("repl_connected"), 1);
+
+        hello.magic = htole32(REPL_MAGIC);
+        hello.version = htole32(REPL_VERSION);
+        hello.log_id = htole64(log_id);
+        hello.next_seq = htole64(applied_seq + 1);
+        if (send_all(fd, &hello, sizeof(hello)))
+            goto reconnect;
+
+        while (recv_all(fd, &batch, sizeof(batch)) == 0){
+            if (le32toh(batch.magic) != REPL_MAGIC){
+                syslog(LOG_ERR, "%s", "Wrong replication batch");
+                break;
+            }
+            if (le64toh(batch.log_id) != log_id){
+                if (log_id)
+                    syslog(LOG_WARNING, "%s", "Primary log changed (primary restarted)");
+                log_id = le64toh(batch.log_id);
+            }
+            size = le32toh(batch.size);
+            if (payload.cap < size){
+                if ((data = realloc(payload.data, size)) == NULL){
+                    syslog(LOG_ERR, "%s: %m", "Error allocate replication batch");
+                    break;
+                }
+                payload.data = data;
+                payload.cap = size;
+            }
+            if (recv_all(fd, payload.data, size))
+                break;
+            if (crc32c(0, payload.data, size) != le32toh(batch.crc)){
+                syslog(LOG_ERR, "%s", "Replication batch checksum mismatch");
+                break;
+            }
+
+            // records applied before failed one are kept, connection is dropped without ack
+            err = repl_apply_batch(payload.data, size, le32toh(batch.count), &applied_seq);
+            // position is kept even if it is not saved, follower continues without restart
+            repl_state_save(log_id, applied_seq);
+            if (err)
+                break;
+
+            head_seq = le64toh(batch.head_seq);
+            metric_set(metric_cached("repl_primary_seq"), head_seq);
+            metric_set(metric_cached("repl_lag_records"), head_seq > applied_seq ? head_seq - applied_seq : 0);
+
+            ack.magic = htole32(REPL_MAGIC);
+            ack.pad = 0;
+            ack.applied_seq = htole64(applied_seq);
+            if (send_all(fd, &ack, sizeof(ack)))
+                break;
+        }
+
+        reconnect: syslog(LOG_ERR, "%s", "Replication connection lost");
+        metric_set(metric_cached("repl_connected"), 0);
+        pthread_mutex_lock(&follower.lock);
+        follower.fd = -1;
+        pthread_mutex_unlock(&follower.lock);
+        close(fd);
+        if (!__atomic_load_n(&stopping, __ATOMIC_SEQ_CST))
+            sleep(REPL_RETRY_S);
+    }
+    pkt_buf_free(&payload);
+    return NULL;
+}
+
+int repl_follower_start(const char *primary_addr){
+    const char *colon = strrchr(primary_addr, ':');
+
+    if (colon == NULL || (size_t)(colon - primary_addr) >= sizeof(follower_host) ||
+            strlen(colon + 1) >= sizeof(follower_port)){
+        syslog(LOG_ERR, "Wrong primary address %s, expected host:port", primary_addr);
+        return -1;
+    }
+    memcpy(follower_host, primary_addr, colon - primary_addr);
+    follower_host[colon - primary_addr] = '\0';
+    strcpy(follower_port, colon + 1);
+
+    if (repl_state_open())
+        return -1;
+    metric_set(metric_cached("repl_applied_seq"), follower.applied_seq);
+    if (pthread_create(&follower.thread, NULL, repl_follower, NULL) != 0){
+        syslog(LOG_ERR, "%s: %m", "Error create follower thread");
+        close(follower.state_fd);
+        follower.state_fd = -1;
+        return -1;
+    }
+    follower.started = 1;
+    return 0;
+}
+
+/*****************************************************
+*
+* Stop
+*
+*****************************************************/
+
+void repl_stop(void){
+    repl_sender_t *s;
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+
+    // follower blocked in recv from primary is woken by shutdown
+    if (follower.started){
+        pthread_mutex_lock(&follower.lock);
+        if (follower.fd >= 0)
+            shutdown(follower.fd, SHUT_RDWR);
+        pthread_mutex_unlock(&follower.lock);
+        pthread_join(follower.thread, NULL);
+        follower.started = 0;
+        close(follower.state_fd);
+        follower.state_fd = -1;
+    }
+
+    if (primary.started){
+        // no new senders after acceptor is joined
+        shutdown(primary.server_fd, SHUT_RDWR);
+        pthread_join(primary.acceptor, NULL);
+        close(primary.server_fd);
+        primary.server_fd = -1;
+
+        pthread_mutex_lock(&primary.lock);
+        for (s = primary.sender_list; s; s = s->next)
+            shutdown(s->fd, SHUT_RDWR);
+        pthread_cond_broadcast(&primary.cond);
+        while (primary.senders)
+            pthread_cond_wait(&primary.cond, &primary.lock);
+        pthread_mutex_unlock(&primary.lock);
+    }
+}
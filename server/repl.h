@@ -0,0 +1,98 @@
+/*
+ * repl.h
+ *
+ * Primary-follower replication of committed packets.
+ *
+ * Primary (-R port) keeps recent committed packets in memory log and
+ * streams them to followers. Follower (-F host:port) connects to primary,
+ * applies received packets to local channels and acknowledges them.
+ *
+ * Wire format (little endian):
+ *   follower -> primary  hello  {magic, version, log_id, next_seq}
+ *   primary  -> follower batch  {magic, count, log_id, head_seq, size, crc} + count records
+ *                        record {seq, ts_ns, size, name_size, pad} + name + data
+ *   follower -> primary  ack    {magic, pad, applied_seq}
+ * seq is global over all channels and starts from 1, ts_ns is commit time
+ * (CLOCK_REALTIME) on primary. crc is crc32c of all records of batch.
+ * log_id identifies run of primary, seqs of other run (follower's log_id of
+ * the last batch) are not continued, primary sends from its oldest record.
+ *
+ * Records are committed data of packets as stored by primary's backend:
+ * unterminated end of packet is not replicated from aesdchar, which drops it.
+ *
+ * Follower keeps log_id and seq of the last applied batch in REPL_STATE_FILE
+ * of channel directory, it is saved after batch is applied and before ack.
+ * Restarted follower continues from it, batch applied just before crash can
+ * be applied again.
+ */
+
+#ifndef AESDSOCKET_REPL_H
+#define AESDSOCKET_REPL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define REPL_MAGIC 0x44534541 /* "AESD" */
+#define REPL_VERSION 3
+#define REPL_LOG_RECORDS 4096           /* records kept for followers */
+#define REPL_LOG_BYTES (16 * 1024 * 1024)
+#define REPL_BATCH_BYTES (64 * 1024)    /* max payload of one batch */
+#define REPL_RETRY_S 1
+#define REPL_CONNECT_S 5                /* timeout of connect to primary */
+#define REPL_STATE_FILE ".repl_follower"
+#define REPL_ACK_POLL_S 1
+
+struct repl_hello{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t log_id;        /* log of applied records, 0 - nothing applied */
+    uint64_t next_seq;
+} __attribute__((packed));
+
+struct repl_batch{
+    uint32_t magic;
+    uint32_t count;
+    uint64_t log_id;
+    uint64_t head_seq;
+    uint32_t size;
+    uint32_t crc;
+} __attribute__((packed));
+
+struct repl_rec{
+    uint64_t seq;
+    uint64_t ts_ns;
+    uint32_t size;
+    uint16_t name_size;
+    uint16_t pad;
+} __attribute__((packed));
+
+struct repl_ack{
+    uint32_t magic;
+    uint32_t pad;
+    uint64_t applied_seq;
+} __attribute__((packed));
+
+/*!
+ * Start primary side: listen for followers on port
+ */
+int repl_primary_start(int port);
+
+/*!
+ * Start follower side
+ * @param primary host:port of primary
+ */
+int repl_follower_start(const char *primary);
+
+/*!
+ * Stop replication threads and wait for them. Called before channels are
+ * destroyed, follower doesn't apply records after it returns.
+ */
+void repl_stop(void);
+
+/*!
+ * Append committed packet of channel to replication log.
+ * Does nothing if primary is not started.
+ */
+void repl_publish(const char *channel, const char *data, size_t size);
+
+#endif /* AESDSOCKET_REPL_H */
@@ -0,0 +1,52 @@
+#!/bin/bash
+# Scheduled write test: packets sent with -j (cost per byte scheduling),
+# alone and together with sharded log (-P), must be stored and returned.
+# Usage: ./sched-test.sh [path to aesdsocket]
+
+AESDSOCKET=${1:-$(dirname $(realpath $0))/aesdsocket}
+PORT=9030
+WORKDIR=$(mktemp -d)
+
+# send packet to port, print response
+send_packet() {
+    exec 3<>/dev/tcp/127.0.0.1/$1 || return 1
+    printf "$2" >&3
+    timeout 1 cat <&3
+    exec 3<&-
+}
+
+cleanup() {
+    kill $server_pid 2>/dev/null
+    wait 2>/dev/null
+    rm -rf ${WORKDIR}
+}
+trap cleanup EXIT
+
+# run server with options, send packets and check the whole log
+run_case() {
+    rm -rf ${WORKDIR}/*
+    ${AESDSOCKET} -p ${PORT} -f ${WORKDIR}/data -D ${WORKDIR}/channels "$@" &
+    server_pid=$!
+    sleep 0.5
+
+    expected=""
+    for i in $(seq 1 5); do
+        send_packet ${PORT} "packet${i}\n" > /dev/null
+        expected="${expected}packet${i}"$'\n'
+    done
+    actual=$(send_packet ${PORT} "AESDCHAR_IOCSEEKTO:0,0\n")
+
+    kill $server_pid
+    wait $server_pid
+    rc=$?
+    if [ ${rc} -ne 0 ] || [ "${actual}" != "${expected%$'\n'}" ]; then
+        echo "Scheduled write test with options $* failed (rc ${rc})"
+        echo "expected: ${expected}"
+        echo "actual:   ${actual}"
+        exit 1
+    fi
+}
+
+run_case -j 1000
+run_case -j 1000 -P 2
+echo "Scheduled write test passed"
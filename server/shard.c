@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <sched.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include "./shard.h"
+#include "./metrics.h"
+
+/* Merge cursor of one shard */
+typedef struct shard_cur_s shard_cur_t;
+struct shard_cur_s{
+    uint64_t rec, nrecs;    /* next record, visible records */
+    uint64_t seq;           /* seq of loaded record */
+    char *buf;
+    size_t cap;
+    uint32_t size;
+    int valid;
+};
+
+/*****************************************************
+*
+* Service Functions
+*
+*****************************************************/
+
+static shard_t *shard_lock_any(shard_log_t *log){
+    int cpu = sched_getcpu();
+    unsigned first = cpu < 0 ? 0 : (unsigned)cpu % log->n;
+
+    // own CPU shard first, busy shard is skipped
+    for (unsigned i = 0; i < log->n; i++)
+        if (pthread_mutex_trylock(&log->shards[(first + i) % log->n].lock) == 0)
+            return &log->shards[(first + i) % log->n];
+    pthread_mutex_lock(&log->shards[first].lock);
+    return &log->shards[first];
+}
+
+/*!
+ * Load record of cursor
+ * @return 0 on success
+ */
+static int shard_cur_load(shard_cur_t *cur, wal_t *wal){
+    uint64_t pos, seq;
+    char *buf;
+
+    cur->valid = 0;
+    if (cur->rec >= cur->nrecs)
+        return 0;
+    if (wal_record(wal, cur->rec, &pos, &cur->size) || cur->size < sizeof(seq))
+        return -1;
+    if (cur->size > cur->cap){
+        if ((buf = realloc(cur->buf, cur->size)) == NULL)
+            return -1;
+        cur->buf = buf;
+        cur->cap = cur->size;
+    }
+    if (wal_pread(wal, cur->buf, cur->size, pos) != cur->size)
+        return -1;
+    memcpy(&seq, cur->buf, sizeof(seq));
+    cur->seq = le64toh(seq);
+    cur->valid = 1;
+    return 0;
+}
+
+/*!
+ * Load record of cursor under lock of its shard, record is copied to cursor buffer
+ * @return 0 on success
+ */
+static int shard_cur_load_locked(shard_cur_t *cur, shard_t *shard){
+    int retval;
+
+    pthread_mutex_lock(&shard->lock);
+    retval = shard_cur_load(cur, shard->wal);
+    pthread_mutex_unlock(&shard->lock);
+    return retval;
+}
+
+/*****************************************************
+*
+* Ordering
+*
+*****************************************************/
+
+/*!
+ * Packet [seq, seq + count) is finished, pass finished packets to sink in order
+ */
+static void shard_finish(shard_log_t *log, uint64_t seq, uint64_t count,
+                         const char *data, size_t size, int ok){
+    shard_slot_t *slot;
+
+    pthread_mutex_lock(&log->order_lock);
+    // slot can be taken by packet SHARD_RING packets older
+    while (seq - log->watermark >= SHARD_RING)
+        pthread_cond_wait(&log->order_cond, &log->order_lock);
+    slot = &log->ring[seq & (SHARD_RING - 1)];
+    slot->seq = seq;
+    slot->count = count;
+    slot->data = data;
+    slot->size = size;
+    slot->state = ok ? 1 : 2;
+
+    while ((slot = &log->ring[log->watermark & (SHARD_RING - 1)])->state &&
+           slot->seq == log->watermark){
+        if (slot->state == 1 && log->sink)
+            log->sink(log->sink_arg, slot->data, slot->size);
+        slot->state = 0;
+        log->watermark += slot->count;
+    }
+    metric_set(metric_cached("shard_watermark"), log->watermark);
+    pthread_cond_broadcast(&log->order_cond);
+
+    // response of packet must include it and everything before
+    while (log->watermark < seq + count)
+        pthread_cond_wait(&log->order_cond, &log->order_lock);
+    pthread_mutex_unlock(&log->order_lock);
+}
+
+/*****************************************************
+*
+* Log interface
+*
+*****************************************************/
+
+int shard_append(shard_log_t *log, const char *data, size_t size){
+    const char *pos = data, *end = data + size, *nl;
+    struct iovec iov[2];
+    uint64_t seq, count = 0, le_seq;
+    shard_t *shard;
+    uint64_t tail;
+    int ok = 1;
+
+    if (size == 0)
+        return 0;
+    for (pos = data; pos < end; count++)
+        pos = (nl = memchr(pos, '\n', end - pos)) ? nl + 1 : end;
+
+    shard = shard_lock_any(log);
+    tail = shard->wal->next_seq;
+    seq = __atomic_fetch_add(&log->next_seq, count, __ATOMIC_SEQ_CST);
+    for (uint64_t i = 0, off = 0; i < count; i++){
+        nl = memchr(data + off, '\n', size - off);
+        le_seq = htole64(seq + i);
+        iov[0].iov_base = &le_seq;
+        iov[0].iov_len = sizeof(le_seq);
+        iov[1].iov_base = (void *)(data + off);
+        iov[1].iov_len = nl ? (size_t)(nl - (data + off)) + 1 : size - off;
+        if (wal_appendv(shard->wal, iov, 2)){
+            ok = 0;
+            break;
+        }
+        off += iov[1].iov_len;
+    }
+    if (ok && wal_commit(shard->wal))
+        ok = 0;
+    // records of failed packet are removed before scan can see them below watermark
+    if (!ok && wal_truncate(shard->wal, tail))
+        syslog(LOG_ERR, "%s", "Error remove records of failed packet");
+    pthread_mutex_unlock(&shard->lock);
+
+    // seqs are taken, failed packet must pass ordering too
+    shard_finish(log, seq, count, data, size, ok);
+    return ok ? 0 : -1;
+}
+
+int shard_scan(shard_log_t *log, shard_rec_fn_t fn, void *arg){
+    shard_cur_t cur[SHARD_MAX];
+    shard_cur_t *min;
+    uint64_t watermark;
+    int retval = 0;
+    unsigned i;
+
+    memset(cur, 0, sizeof(cur));
+    pthread_mutex_lock(&log->order_lock);
+    watermark = log->watermark;
+    pthread_mutex_unlock(&log->order_lock);
+
+    // records below watermark are written, later appends go after nrecs.
+    // Shard is locked only while record is copied, fn (send to client) runs unlocked
+    for (i = 0; i < log->n; i++){
+        pthread_mutex_lock(&log->shards[i].lock);
+        cur[i].nrecs = wal_records(log->shards[i].wal);
+        if (shard_cur_load(&cur[i], log->shards[i].wal))
+            retval = -1;
+        pthread_mutex_unlock(&log->shards[i].lock);
+    }
+
+    while (retval == 0){
+        min = NULL;
+        for (i = 0; i < log->n; i++)
+            if (cur[i].valid && cur[i].seq < watermark && (min == NULL || cur[i].seq < min->seq))
+                min = &cur[i];
+        if (min == NULL)
+            break;
+        if (fn(arg, min->buf + sizeof(uint64_t), min->size - sizeof(uint64_t)))
+            break;
+        min->rec++;
+        if (shard_cur_load_locked(min, &log->shards[min - cur]))
+            retval = -1;
+    }
+
+    for (i = 0; i < log->n; i++)
+        free(cur[i].buf);
+    return retval;
+}
+
+shard_log_t *shard_open(const char *dir, const wal_opts_t *opts, shard_sink_t sink, void *sink_arg){
+    char path[PATH_MAX];
+    wal_opts_t shard_opts = *opts;
+    shard_cur_t cur = {0};
+    shard_log_t *log;
+
+    if (opts->shards < 1 || opts->shards > SHARD_MAX){
+        syslog(LOG_ERR, "Wrong number of shards %u", opts->shards);
+        return NULL;
+    }
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST){
+        syslog(LOG_ERR, "%s %s: %m", "Error create log directory", dir);
+        return NULL;
+    }
+    if ((log = calloc(1, sizeof(shard_log_t))) == NULL){
+        syslog(LOG_ERR, "%s: %m", "Error allocate memory for log");
+        return NULL;
+    }
+    pthread_mutex_init(&log->order_lock, NULL);
+    pthread_cond_init(&log->order_cond, NULL);
+    log->sink = sink;
+    log->sink_arg = sink_arg;
+
+    // retention of one shard would cut holes in merged history
+    shard_opts.retain_records = shard_opts.retain_bytes = 0;
+    for (; log->n < opts->shards; log->n++){
+        if (snprintf(path, sizeof(path), "%s/" SHARD_DIR_FMT, dir, log->n) >= (int)sizeof(path) ||
+            (log->shards[log->n].wal = wal_open(path, &shard_opts)) == NULL){
+            shard_close(log);
+            return NULL;
+        }
+        pthread_mutex_init(&log->shards[log->n].lock, NULL);
+
+        // continue after the last seq of all shards
+        cur.nrecs = wal_records(log->shards[log->n].wal);
+        cur.rec = cur.nrecs ? cur.nrecs - 1 : 0;
+        if (shard_cur_load(&cur, log->shards[log->n].wal) == 0 && cur.valid && cur.seq >= log->next_seq)
+            log->next_seq = cur.seq + 1;
+    }
+    free(cur.buf);
+    log->watermark = log->next_seq;
+    syslog(LOG_DEBUG, "Sharded log %s: %u shards, next seq %llu", dir, log->n,
+           (unsigned long long)log->next_seq);
+    return log;
+}
+
+void shard_close(shard_log_t *log){
+    for (unsigned i = 0; i < log->n; i++){
+        wal_close(log->shards[i].wal);
+        pthread_mutex_destroy(&log->shards[i].lock);
+    }
+    pthread_mutex_destroy(&log->order_lock);
+    pthread_cond_destroy(&log->order_cond);
+    free(log);
+}
@@ -0,0 +1,95 @@
+/*
+ * shard.h
+ *
+ * Sharded log of file backend channel (-P option).
+ * Channel directory holds shard logs s0..sN-1 (wal.h). Packet is appended
+ * to the shard of the writer's CPU under lock of that shard only, so
+ * packets of one channel are written and synced in parallel.
+ * Every record gets global sequence number from atomic counter, taken
+ * under shard lock so it grows inside shard too. Seq is stored as 8 byte
+ * little endian prefix of record data.
+ *
+ * Packets are finished out of order. Ordering stage keeps committed
+ * watermark, all seqs below it are finished. When watermark advances,
+ * packets are passed to sink (cache, replication) in seq order. Writer
+ * waits until watermark passes its packet before response, so clients
+ * see one ordered history as with channel lock. Readers merge shards
+ * by seq up to watermark. Failed packet passes ordering without records:
+ * its written records are removed from shard before shard is unlocked.
+ *
+ * Unterminated data at the end of appended data becomes a record of its
+ * own, aesdsocket appends only complete packets. Retention (-K) is not
+ * applied to shards.
+ */
+
+#ifndef AESDSOCKET_SHARD_H
+#define AESDSOCKET_SHARD_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "./wal.h"
+
+#define SHARD_MAX 64
+#define SHARD_RING 4096     /* max packets in flight, power of 2 */
+#define SHARD_DIR_FMT "s%u"
+
+/* Called in seq order under ordering lock */
+typedef void (*shard_sink_t)(void *arg, const char *data, size_t size);
+
+/* Called for every record by shard_scan, non zero stops scan */
+typedef int (*shard_rec_fn_t)(void *arg, const char *data, size_t size);
+
+typedef struct shard_s shard_t;
+struct shard_s{
+    pthread_mutex_t lock;
+    wal_t *wal;
+};
+
+/* Finished packet waiting for older ones */
+typedef struct shard_slot_s shard_slot_t;
+struct shard_slot_s{
+    uint64_t seq;
+    uint64_t count;         /* records (seqs) of packet */
+    const char *data;
+    size_t size;
+    int state;              /* 0 - free, 1 - written, 2 - failed */
+};
+
+typedef struct shard_log_s shard_log_t;
+struct shard_log_s{
+    unsigned n;
+    shard_t shards[SHARD_MAX];
+    uint64_t next_seq;      /* atomic */
+
+    pthread_mutex_t order_lock;
+    pthread_cond_t order_cond;
+    uint64_t watermark;
+    shard_slot_t ring[SHARD_RING];
+    shard_sink_t sink;
+    void *sink_arg;
+};
+
+/*!
+ * Open or create sharded log, opts->shards is number of shards
+ * @param sink receiver of packets in seq order
+ * @return log or NULL on error
+ */
+shard_log_t *shard_open(const char *dir, const wal_opts_t *opts, shard_sink_t sink, void *sink_arg);
+
+void shard_close(shard_log_t *log);
+
+/*!
+ * Append packet, thread safe. Every newline terminated command is a record.
+ * Returns when packet and all older ones are passed to sink.
+ * @return 0 on success
+ */
+int shard_append(shard_log_t *log, const char *data, size_t size);
+
+/*!
+ * Call fn for every committed record in seq order. Appends go on during scan,
+ * shard is locked only while its record is read, fn is called without locks.
+ * @return 0 on success
+ */
+int shard_scan(shard_log_t *log, shard_rec_fn_t fn, void *arg);
+
+#endif /* AESDSOCKET_SHARD_H */
@@ -0,0 +1,137 @@
+/*
+ * Ingest throughput of sharded log with concurrent writers.
+ * Every thread appends packets of one record in sync mode, as clients
+ * of one channel do. One shard is the single log with its lock.
+ * Usage: ./shard_bench [dir [threads [packets per thread [packet size]]]]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "./shard.h"
+#include "./metrics.h"
+
+typedef struct writer_s writer_t;
+struct writer_s{
+    pthread_t thr;
+    shard_log_t *log;
+    size_t packets;
+    char *data;
+    size_t size;
+    int err;
+};
+
+static double now_s(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void remove_dir(const char *dir){
+    char path[PATH_MAX + 256];
+    struct dirent *de;
+    DIR *d = opendir(dir);
+
+    if (d == NULL)
+        return;
+    while ((de = readdir(d)) != NULL){
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (de->d_type == DT_DIR)
+            remove_dir(path);
+        else
+            unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+static void *writer(void *arg){
+    writer_t *w = arg;
+
+    for (size_t i = 0; i < w->packets; i++)
+        if (shard_append(w->log, w->data, w->size)){
+            w->err = 1;
+            break;
+        }
+    return NULL;
+}
+
+static int count_rec(void *arg, const char *data, size_t size){
+    (*(size_t *)arg)++;
+    return 0;
+}
+
+static int bench(const char *dir, unsigned shards, size_t threads, size_t packets, size_t size){
+    wal_opts_t opts = WAL_OPTS_DEFAULT;
+    writer_t *w;
+    shard_log_t *log;
+    size_t i, recs = 0;
+    long fsyncs;
+    double total;
+    int retval = 0;
+
+    opts.shards = shards;
+    if ((w = calloc(threads, sizeof(writer_t))) == NULL)
+        return -1;
+    remove_dir(dir);
+    if ((log = shard_open(dir, &opts, NULL, NULL)) == NULL){
+        printf("Error open log %s\n", dir);
+        free(w);
+        return -1;
+    }
+    fsyncs = metric_value(metric_get("wal_fsyncs"));
+    total = now_s();
+    for (i = 0; i < threads; i++){
+        w[i].log = log;
+        w[i].packets = packets;
+        w[i].size = size;
+        if ((w[i].data = malloc(size)) == NULL)
+            return -1;
+        memset(w[i].data, 'a' + i % 26, size);
+        w[i].data[size - 1] = '\n';
+        pthread_create(&w[i].thr, NULL, writer, &w[i]);
+    }
+    for (i = 0; i < threads; i++){
+        pthread_join(w[i].thr, NULL);
+        retval |= w[i].err;
+        free(w[i].data);
+    }
+    total = now_s() - total;
+    fsyncs = metric_value(metric_get("wal_fsyncs")) - fsyncs;
+    shard_scan(log, count_rec, &recs);
+
+    printf("%-8u %12.0f %10ld %10zu\n", shards, threads * packets / total, fsyncs, recs);
+    shard_close(log);
+    remove_dir(dir);
+    free(w);
+    if (retval || recs != threads * packets){
+        printf("Error write log\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    const char *dir = argc > 1 ? argv[1] : "shard_bench.d";
+    size_t threads = argc > 2 ? atoi(argv[2]) : 8;
+    size_t packets = argc > 3 ? atoi(argv[3]) : 500;
+    size_t size = argc > 4 ? atoi(argv[4]) : 128;
+
+    if (threads == 0 || packets == 0 || size == 0)
+        return 1;
+    printf("%zu threads, %zu packets of %zu bytes each in %s, sync mode\n", threads, packets, size, dir);
+    printf("%-8s %12s %10s %10s\n", "shards", "packets/s", "fsyncs", "records");
+    for (unsigned shards = 1; shards <= SHARD_MAX; shards *= 2){
+        if (bench(dir, shards, threads, packets, size))
+            return 1;
+        if (shards >= threads)
+            break;
+    }
+    return 0;
+}
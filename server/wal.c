@@ -0,0 +1,967 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <endian.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "./wal.h"
+#include "./crc32c.h"
+#include "./metrics.h"
+
+#define WAL_HDR_CRC_OFFS offsetof(struct wal_rec_hdr, size)
+#define WAL_IDX_LEN(n) (sizeof(struct wal_idx_hdr) + (n) * sizeof(struct wal_idx_ent))
+
+/* Read window of segment scan */
+typedef struct wal_win_s wal_win_t;
+struct wal_win_s{
+    char *buf;
+    size_t cap;
+    off_t off;      /* offset of buf in file */
+    size_t len;     /* valid bytes in buf */
+};
+
+/*****************************************************
+*
+* Service Functions
+*
+*****************************************************/
+
+static int wal_grow(void **arr, size_t *cap, size_t need, size_t elem_size){
+    size_t new_cap = *cap ? *cap : 64;
+    void *new_arr;
+
+    if (need <= *cap)
+        return 0;
+    while (new_cap < need)
+        new_cap *= 2;
+    if ((new_arr = realloc(*arr, new_cap * elem_size)) == NULL){
+        syslog(LOG_ERR, "%s: %m", "Error allocate memory for log");
+        return -1;
+    }
+    *arr = new_arr;
+    *cap = new_cap;
+    return 0;
+}
+
+static time_t wal_now_s(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void wal_seg_path(wal_t *wal, uint64_t first_seq, char *path, size_t size){
+    snprintf(path, size, "%s/" WAL_SEGMENT_FMT, wal->dir, (unsigned long long)first_seq);
+}
+
+static void wal_idx_path(wal_t *wal, uint64_t first_seq, char *path, size_t size){
+    snprintf(path, size, "%s/" WAL_INDEX_FMT, wal->dir, (unsigned long long)first_seq);
+}
+
+static void wal_dir_sync(wal_t *wal){
+    int fd = open(wal->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0 || fsync(fd) == -1)
+        syslog(LOG_ERR, "%s %s: %m", "Error sync log directory", wal->dir);
+    if (fd >= 0)
+        close(fd);
+}
+
+static int wal_fdatasync(int fd){
+    if (fdatasync(fd) == -1){
+        syslog(LOG_ERR, "%s: %m", "Error sync segment");
+        return -1;
+    }
+    metric_add(metric_cached("wal_fsyncs"), 1);
+    return 0;
+}
+
+static uint32_t wal_rec_crc(const struct wal_rec_hdr *hdr, const char *data, size_t size){
+    uint32_t crc = crc32c(0, (const char *)hdr + WAL_HDR_CRC_OFFS, sizeof(*hdr) - WAL_HDR_CRC_OFFS);
+    return crc32c(crc, data, size);
+}
+
+/*****************************************************
+*
+* Segment index
+*
+*****************************************************/
+
+/*!
+ * Map index file of segment with room for cap entries, file is extended if needed
+ */
+static int wal_idx_map(wal_seg_t *seg, size_t cap){
+    struct stat st;
+    void *map;
+
+    if (fstat(seg->idx_fd, &st) == -1 ||
+        ((size_t)st.st_size < WAL_IDX_LEN(cap) && ftruncate(seg->idx_fd, WAL_IDX_LEN(cap)) == -1)){
+        syslog(LOG_ERR, "%s: %m", "Error resize index");
+        return -1;
+    }
+    map = mmap(NULL, WAL_IDX_LEN(cap), PROT_READ | PROT_WRITE, MAP_SHARED, seg->idx_fd, 0);
+    if (map == MAP_FAILED){
+        syslog(LOG_ERR, "%s: %m", "Error map index");
+        return -1;
+    }
+    if (seg->idx)
+        munmap(seg->idx, WAL_IDX_LEN(seg->idx_cap));
+    seg->idx = map;
+    seg->ents = (struct wal_idx_ent *)(seg->idx + 1);
+    seg->idx_cap = cap;
+    return 0;
+}
+
+static void wal_idx_reset(wal_seg_t *seg, uint64_t base){
+    seg->idx->magic = htole32(WAL_IDX_MAGIC);
+    seg->idx->flags = 0;
+    seg->idx->nrecs = 0;
+    seg->idx->base = htole64(base);
+    seg->nrecs = 0;
+    seg->base = base;
+}
+
+/*!
+ * @return 1 if index of segment is sealed and matches segment file
+ */
+static int wal_idx_trusted(wal_seg_t *seg){
+    struct wal_idx_hdr *hdr = seg->idx;
+    struct wal_idx_ent *last;
+    uint64_t nrecs = le64toh(hdr->nrecs);
+
+    if (le32toh(hdr->magic) != WAL_IDX_MAGIC || !(le32toh(hdr->flags) & WAL_IDX_SEALED) ||
+        nrecs == 0 || nrecs > seg->idx_cap)
+        return 0;
+    last = &seg->ents[nrecs - 1];
+    return le32toh(seg->ents[0].off) == sizeof(struct wal_rec_hdr) &&
+           le32toh(last->off) + le32toh(last->size) == seg->size &&
+           le64toh(seg->ents[0].pos) == le64toh(hdr->base);
+}
+
+/*!
+ * Segment is closed: index is written to disk and marked as trusted
+ */
+static void wal_idx_seal(wal_seg_t *seg){
+    if (msync(seg->idx, WAL_IDX_LEN(seg->nrecs), MS_SYNC) == -1){
+        syslog(LOG_ERR, "%s: %m", "Error sync index");
+        return;
+    }
+    // header goes after entries
+    seg->idx->flags = htole32(WAL_IDX_SEALED);
+    if (msync(seg->idx, sizeof(struct wal_idx_hdr), MS_SYNC) == -1)
+        syslog(LOG_ERR, "%s: %m", "Error sync index");
+    if (ftruncate(seg->idx_fd, WAL_IDX_LEN(seg->nrecs)) == -1)
+        syslog(LOG_ERR, "%s: %m", "Error truncate index");
+}
+
+/*!
+ * Add record of the last segment
+ */
+static int wal_idx_add(wal_t *wal, off_t off, uint32_t size){
+    wal_seg_t *seg = &wal->segs[wal->nsegs - 1];
+    struct wal_idx_ent *ent;
+    uint64_t pos = wal_size(wal);
+
+    if (seg->nrecs == seg->idx_cap && wal_idx_map(seg, seg->idx_cap ? seg->idx_cap * 2 : WAL_IDX_GROW))
+        return -1;
+    ent = &seg->ents[seg->nrecs];
+    ent->pos = htole64(pos);
+    ent->off = htole32(off);
+    ent->size = htole32(size);
+    seg->nrecs++;
+    seg->idx->nrecs = htole64(seg->nrecs);
+    return 0;
+}
+
+/*!
+ * @return segment which contains record seq (first_seq <= seq < next_seq)
+ */
+static wal_seg_t *wal_seg_of_seq(wal_t *wal, uint64_t seq){
+    size_t lo = 0, hi = wal->nsegs - 1, mid;
+
+    while (lo < hi){
+        mid = lo + (hi - lo + 1) / 2;
+        if (wal->segs[mid].first_seq <= seq)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return &wal->segs[lo];
+}
+
+static struct wal_idx_ent *wal_ent(wal_t *wal, uint64_t seq){
+    wal_seg_t *seg = wal_seg_of_seq(wal, seq);
+    return &seg->ents[seq - seg->first_seq];
+}
+
+/*!
+ * Find record which contains pos (pos < wal_size)
+ * @param seg_num segment number
+ * @return record number in segment
+ */
+static size_t wal_rec_of_pos(wal_t *wal, uint64_t pos, size_t *seg_num){
+    size_t lo = 0, hi = wal->nsegs - 1, mid;
+    wal_seg_t *seg;
+
+    while (lo < hi){
+        mid = lo + (hi - lo + 1) / 2;
+        if (wal->segs[mid].base <= pos)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    *seg_num = lo;
+    seg = &wal->segs[lo];
+
+    lo = 0;
+    hi = seg->nrecs - 1;
+    while (lo < hi){
+        mid = lo + (hi - lo + 1) / 2;
+        if (le64toh(seg->ents[mid].pos) <= pos)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/*****************************************************
+*
+* Segments
+*
+*****************************************************/
+
+/*!
+ * Add segment with open file to log and open its index
+ * @param create new segment, index is created empty
+ */
+static int wal_seg_add(wal_t *wal, uint64_t first_seq, int fd, off_t size, int create){
+    char path[PATH_MAX + 32];
+    wal_seg_t *seg;
+    struct stat st;
+    size_t cap;
+
+    if (wal_grow((void **)&wal->segs, &wal->segs_cap, wal->nsegs + 1, sizeof(wal_seg_t)))
+        return -1;
+    seg = &wal->segs[wal->nsegs];
+    memset(seg, 0, sizeof(wal_seg_t));
+    seg->first_seq = first_seq;
+    seg->fd = fd;
+    seg->size = size;
+    seg->created = wal_now_s();
+
+    wal_idx_path(wal, first_seq, path, sizeof(path));
+    seg->idx_fd = open(path, O_CREAT | O_RDWR | O_CLOEXEC | (create ? O_TRUNC : 0), 0644);
+    if (seg->idx_fd < 0 || fstat(seg->idx_fd, &st) == -1){
+        syslog(LOG_ERR, "%s %s: %m", "Error open index", path);
+        goto err;
+    }
+    cap = (size_t)st.st_size > sizeof(struct wal_idx_hdr) ?
+          (st.st_size - sizeof(struct wal_idx_hdr)) / sizeof(struct wal_idx_ent) : 0;
+    if (wal_idx_map(seg, create ? WAL_IDX_GROW : cap))
+        goto err;
+    if (create)
+        wal_idx_reset(seg, wal_size(wal));
+    wal->nsegs++;
+    return 0;
+
+    err: if (seg->idx_fd >= 0)
+        close(seg->idx_fd);
+    return -1;
+}
+
+static void wal_seg_close(wal_seg_t *seg){
+    munmap(seg->idx, WAL_IDX_LEN(seg->idx_cap));
+    if (close(seg->idx_fd) == -1 || close(seg->fd) == -1)
+        syslog(LOG_ERR, "%s: %m", "Error close segment");
+}
+
+static int wal_seg_create(wal_t *wal, uint64_t first_seq){
+    char path[PATH_MAX + 32];
+    int fd;
+
+    wal_seg_path(wal, first_seq, path, sizeof(path));
+    fd = open(path, O_CREAT | O_EXCL | O_RDWR | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0){
+        syslog(LOG_ERR, "%s %s: %m", "Error create segment", path);
+        return -1;
+    }
+    if (wal_seg_add(wal, first_seq, fd, 0, 1)){
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    wal_dir_sync(wal);
+    return 0;
+}
+
+/*****************************************************
+*
+* Recovery
+*
+*****************************************************/
+
+/*!
+ * Make sure window contains [off, off + len) of file
+ * @return 0 on success, -1 if file is shorter or read error
+ */
+static int wal_win_get(wal_win_t *win, int fd, off_t off, size_t len){
+    ssize_t n;
+
+    if (off >= win->off && off + len <= win->off + win->len)
+        return 0;
+    if (len > win->cap){
+        free(win->buf);
+        win->cap = len > WAL_SCAN_BUF ? len : WAL_SCAN_BUF;
+        if ((win->buf = malloc(win->cap)) == NULL){
+            win->cap = win->len = 0;
+            return -1;
+        }
+    }
+    win->off = off;
+    win->len = 0;
+    if ((n = pread(fd, win->buf, win->cap, off)) < 0)
+        return -1;
+    win->len = n;
+    return win->len >= len ? 0 : -1;
+}
+
+/*!
+ * Scan records of the last segment, add them to index
+ * @return offset of first bad record or size of segment if all records are good
+ */
+static off_t wal_seg_scan(wal_t *wal, wal_win_t *win){
+    wal_seg_t *seg = &wal->segs[wal->nsegs - 1];
+    struct wal_rec_hdr hdr;
+    const char *data;
+    off_t off = 0;
+    uint32_t size;
+
+    if (seg->first_seq != wal->next_seq)
+        return 0;
+
+    win->off = win->len = 0;
+    while (off < seg->size){
+        if (wal_win_get(win, seg->fd, off, sizeof(hdr)))
+            break;
+        memcpy(&hdr, win->buf + (off - win->off), sizeof(hdr));
+        size = le32toh(hdr.size);
+        if (le64toh(hdr.seq) != wal->next_seq || off + sizeof(hdr) + size > seg->size)
+            break;
+        if (wal_win_get(win, seg->fd, off, sizeof(hdr) + size))
+            break;
+        data = win->buf + (off - win->off) + sizeof(hdr);
+        if (le32toh(hdr.crc) != wal_rec_crc(&hdr, data, size))
+            break;
+
+        if (wal_idx_add(wal, off + sizeof(hdr), size))
+            break;
+        wal->next_seq++;
+        off += sizeof(hdr) + size;
+    }
+    return off;
+}
+
+static int seq_cmp(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*!
+ * Open all segments of directory and rebuild index.
+ * Segments with sealed index are not read.
+ */
+static int wal_recover(wal_t *wal){
+    char path[PATH_MAX + 32];
+    uint64_t *seqs = NULL;
+    size_t nseqs = 0, seqs_cap = 0, i, scanned = 0;
+    unsigned long long seq;
+    struct dirent *de;
+    struct stat st;
+    wal_win_t win = {0};
+    wal_seg_t *seg;
+    uint64_t base;
+    off_t good;
+    DIR *dir;
+    int fd, retval = -1;
+
+    if ((dir = opendir(wal->dir)) == NULL){
+        syslog(LOG_ERR, "%s %s: %m", "Error open log directory", wal->dir);
+        return -1;
+    }
+    while ((de = readdir(dir)) != NULL){
+        char tail[8];
+        if (sscanf(de->d_name, "%20llu%7s", &seq, tail) != 2 || strcmp(tail, ".log"))
+            continue;
+        if (wal_grow((void **)&seqs, &seqs_cap, nseqs + 1, sizeof(uint64_t)))
+            goto out;
+        seqs[nseqs++] = seq;
+    }
+    qsort(seqs, nseqs, sizeof(uint64_t), seq_cmp);
+
+    wal->first_seq = wal->next_seq = nseqs ? seqs[0] : 1;
+
+    for (i = 0; i < nseqs; i++){
+        wal_seg_path(wal, seqs[i], path, sizeof(path));
+        if ((fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC)) < 0 || fstat(fd, &st) == -1){
+            syslog(LOG_ERR, "%s %s: %m", "Error open segment", path);
+            if (fd >= 0)
+                close(fd);
+            goto out;
+        }
+        base = wal_size(wal);
+        if (wal_seg_add(wal, seqs[i], fd, st.st_size, 0)){
+            close(fd);
+            goto out;
+        }
+        seg = &wal->segs[wal->nsegs - 1];
+
+        // the last segment can have records after seal, it is always scanned
+        if (i + 1 < nseqs && seg->first_seq == wal->next_seq && wal_idx_trusted(seg) &&
+            (i == 0 || le64toh(seg->idx->base) == base)){
+            seg->nrecs = le64toh(seg->idx->nrecs);
+            seg->base = le64toh(seg->idx->base);
+            wal->next_seq += seg->nrecs;
+            continue;
+        }
+
+        // first segment keeps stream positions of previous run
+        if (i == 0 && le32toh(seg->idx->magic) == WAL_IDX_MAGIC)
+            base = le64toh(seg->idx->base);
+        wal_idx_reset(seg, base);
+        scanned++;
+        good = wal_seg_scan(wal, &win);
+        if (good < st.st_size){
+            syslog(LOG_WARNING, "Torn record in %s at %lld, log is truncated",
+                    path, (long long)good);
+            if (ftruncate(fd, good) == -1)
+                syslog(LOG_ERR, "%s %s: %m", "Error truncate segment", path);
+            seg->size = good;
+            i++;
+            break;
+        }
+    }
+
+    // everything after torn record is lost
+    for (; i < nseqs; i++){
+        wal_idx_path(wal, seqs[i], path, sizeof(path));
+        unlink(path);
+        wal_seg_path(wal, seqs[i], path, sizeof(path));
+        syslog(LOG_WARNING, "Remove segment %s after torn record", path);
+        if (unlink(path) == -1)
+            syslog(LOG_ERR, "%s %s: %m", "Error remove segment", path);
+    }
+
+    wal->start_seq = wal->first_seq;
+    syslog(LOG_DEBUG, "Log %s recovered: %zu segments (%zu scanned), records %llu..%llu",
+            wal->dir, wal->nsegs, scanned,
+            (unsigned long long)wal->first_seq, (unsigned long long)wal->next_seq - 1);
+    retval = 0;
+
+    out: closedir(dir);
+    free(seqs);
+    free(win.buf);
+    return retval;
+}
+
+/*****************************************************
+*
+* Background thread
+*
+*****************************************************/
+
+/*!
+ * Close and delete removed segments
+ */
+static void wal_gc_run(wal_t *wal, wal_seg_t *gc, size_t ngc){
+    char path[PATH_MAX + 32];
+
+    for (size_t i = 0; i < ngc; i++){
+        wal_seg_close(&gc[i]);
+        // index first, segment without index is scanned on open
+        wal_idx_path(wal, gc[i].first_seq, path, sizeof(path));
+        unlink(path);
+        wal_seg_path(wal, gc[i].first_seq, path, sizeof(path));
+        if (unlink(path) == -1)
+            syslog(LOG_ERR, "%s %s: %m", "Error delete segment", path);
+        else
+            syslog(LOG_DEBUG, "Segment %s deleted", path);
+    }
+    if (ngc){
+        wal_dir_sync(wal);
+        metric_add(metric_cached("wal_segments_deleted"), ngc);
+    }
+}
+
+/*!
+ * Group mode: sync current segment every sync_ms or when sync_bytes are written.
+ * Retention: delete segments removed from log.
+ */
+static void *wal_bg_thread(void *arg){
+    wal_t *wal = arg;
+    struct timespec deadline;
+    wal_seg_t *gc;
+    size_t ngc;
+    int fd, group = wal->opts.sync_mode == WAL_SYNC_GROUP;
+
+    pthread_mutex_lock(&wal->bg_lock);
+    while (!wal->bg_stop){
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wal->opts.sync_ms / 1000;
+        deadline.tv_nsec += (wal->opts.sync_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!wal->bg_stop && !wal->ngc && (!group || wal->unsynced < wal->opts.sync_bytes)){
+            if (!group)
+                pthread_cond_wait(&wal->bg_cond, &wal->bg_lock);
+            else if (pthread_cond_timedwait(&wal->bg_cond, &wal->bg_lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+
+        if (group && wal->unsynced && wal->sync_fd >= 0){
+            fd = wal->sync_fd;
+            wal->unsynced = 0;
+            pthread_mutex_unlock(&wal->bg_lock);
+            wal_fdatasync(fd);
+            pthread_mutex_lock(&wal->bg_lock);
+        }
+        if (wal->ngc){
+            gc = wal->gc;
+            ngc = wal->ngc;
+            wal->gc = NULL;
+            wal->ngc = wal->gc_cap = 0;
+            pthread_mutex_unlock(&wal->bg_lock);
+            wal_gc_run(wal, gc, ngc);
+            free(gc);
+            pthread_mutex_lock(&wal->bg_lock);
+        }
+    }
+    pthread_mutex_unlock(&wal->bg_lock);
+    return NULL;
+}
+
+/*****************************************************
+*
+* Retention
+*
+*****************************************************/
+
+/*!
+ * Trim records out of retention, remove segments which have no visible records
+ */
+static void wal_retain(wal_t *wal){
+    const wal_opts_t *opts = &wal->opts;
+    size_t k = 0;
+    int queued = 0;
+
+    while (wal->start_seq < wal->next_seq &&
+           ((opts->retain_records && wal->next_seq - wal->start_seq > opts->retain_records) ||
+            (opts->retain_bytes && wal->next_seq - wal->start_seq > 1 &&
+             wal_size(wal) - le64toh(wal_ent(wal, wal->start_seq)->pos) > opts->retain_bytes)))
+        wal->start_seq++;
+
+    // current segment is never removed
+    while (k + 1 < wal->nsegs && wal->segs[k + 1].first_seq <= wal->start_seq)
+        k++;
+    if (k == 0)
+        return;
+
+    if (wal->bg_running){
+        pthread_mutex_lock(&wal->bg_lock);
+        if (wal_grow((void **)&wal->gc, &wal->gc_cap, wal->ngc + k, sizeof(wal_seg_t)) == 0){
+            memcpy(wal->gc + wal->ngc, wal->segs, k * sizeof(wal_seg_t));
+            wal->ngc += k;
+            pthread_cond_signal(&wal->bg_cond);
+            queued = 1;
+        }
+        pthread_mutex_unlock(&wal->bg_lock);
+    }
+    if (!queued)
+        wal_gc_run(wal, wal->segs, k);
+
+    memmove(wal->segs, wal->segs + k, (wal->nsegs - k) * sizeof(wal_seg_t));
+    wal->nsegs -= k;
+    wal->first_seq = wal->segs[0].first_seq;
+}
+
+/*****************************************************
+*
+* Durability
+*
+*****************************************************/
+
+int wal_commit(wal_t *wal){
+    if (wal->opts.sync_mode != WAL_SYNC_PACKET || !wal->dirty)
+        return 0;
+    wal->dirty = 0;
+    return wal_fdatasync(wal->segs[wal->nsegs - 1].fd);
+}
+
+int wal_parse_segment(const char *arg, wal_opts_t *opts){
+    unsigned long long bytes;
+    unsigned age = 0;
+
+    if (sscanf(arg, "%llu:%u", &bytes, &age) < 1 || bytes < WAL_SEGMENT_MIN || bytes > UINT32_MAX)
+        return -1;
+    opts->seg_max = bytes;
+    opts->seg_age_s = age;
+    return 0;
+}
+
+int wal_parse_retain(const char *arg, wal_opts_t *opts){
+    unsigned long long records, bytes = 0;
+
+    if (sscanf(arg, "%llu:%llu", &records, &bytes) < 1)
+        return -1;
+    opts->retain_records = records;
+    opts->retain_bytes = bytes;
+    return 0;
+}
+
+int wal_parse_sync(const char *arg, wal_opts_t *opts){
+    unsigned ms = WAL_GROUP_SYNC_MS;
+    unsigned long bytes = WAL_GROUP_SYNC_BYTES;
+
+    if (strcmp(arg, "sync") == 0)
+        opts->sync_mode = WAL_SYNC_PACKET;
+    else if (strcmp(arg, "none") == 0)
+        opts->sync_mode = WAL_SYNC_NONE;
+    else if (strncmp(arg, "group", 5) == 0 && (arg[5] == '\0' || arg[5] == ':')){
+        if (arg[5] == ':' && sscanf(arg + 6, "%u:%lu", &ms, &bytes) < 1)
+            return -1;
+        if (ms == 0 || bytes == 0)
+            return -1;
+        opts->sync_mode = WAL_SYNC_GROUP;
+        opts->sync_ms = ms;
+        opts->sync_bytes = bytes;
+    }
+    else
+        return -1;
+    return 0;
+}
+
+/*****************************************************
+*
+* Log interface
+*
+*****************************************************/
+
+wal_t *wal_open(const char *dir, const wal_opts_t *opts){
+    const wal_opts_t default_opts = WAL_OPTS_DEFAULT;
+    wal_t *wal;
+
+    if (strlen(dir) >= sizeof(wal->dir)){
+        syslog(LOG_ERR, "Log directory name too long %s", dir);
+        return NULL;
+    }
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST){
+        syslog(LOG_ERR, "%s %s: %m", "Error create log directory", dir);
+        return NULL;
+    }
+    if ((wal = malloc(sizeof(wal_t))) == NULL){
+        syslog(LOG_ERR, "%s: %m", "Error allocate memory for log");
+        return NULL;
+    }
+    memset(wal, 0, sizeof(wal_t));
+    strcpy(wal->dir, dir);
+    wal->opts = opts ? *opts : default_opts;
+    if (!wal->opts.seg_max)
+        wal->opts.seg_max = WAL_SEGMENT_SIZE;
+    wal->sync_fd = -1;
+    pthread_mutex_init(&wal->bg_lock, NULL);
+    pthread_cond_init(&wal->bg_cond, NULL);
+
+    if (wal_recover(wal)){
+        wal_close(wal);
+        return NULL;
+    }
+    // old segments left by previous run are deleted here
+    wal_retain(wal);
+
+    if (wal->opts.sync_mode == WAL_SYNC_GROUP || wal->opts.retain_records || wal->opts.retain_bytes){
+        if (pthread_create(&wal->bg_thread, NULL, wal_bg_thread, wal) != 0){
+            syslog(LOG_ERR, "%s: %m", "Error create log thread");
+            // sync and delete in caller thread
+            if (wal->opts.sync_mode == WAL_SYNC_GROUP)
+                wal->opts.sync_mode = WAL_SYNC_PACKET;
+        }
+        else
+            wal->bg_running = 1;
+    }
+    return wal;
+}
+
+void wal_close(wal_t *wal){
+    if (wal->bg_running){
+        pthread_mutex_lock(&wal->bg_lock);
+        wal->bg_stop = 1;
+        pthread_cond_signal(&wal->bg_cond);
+        pthread_mutex_unlock(&wal->bg_lock);
+        pthread_join(wal->bg_thread, NULL);
+        wal->bg_running = 0;
+    }
+    wal_gc_run(wal, wal->gc, wal->ngc);
+    free(wal->gc);
+    if (wal->opts.sync_mode != WAL_SYNC_NONE && wal->nsegs)
+        wal_fdatasync(wal->segs[wal->nsegs - 1].fd);
+    for (size_t i = 0; i < wal->nsegs; i++)
+        wal_seg_close(&wal->segs[i]);
+    free(wal->segs);
+    free(wal->pending);
+    pthread_mutex_destroy(&wal->bg_lock);
+    pthread_cond_destroy(&wal->bg_cond);
+    free(wal);
+}
+
+int wal_append(wal_t *wal, const char *data, size_t size){
+    struct iovec iov = {(void *)data, size};
+    return wal_appendv(wal, &iov, 1);
+}
+
+int wal_appendv(wal_t *wal, const struct iovec *data, int cnt){
+    struct wal_rec_hdr hdr;
+    struct iovec iov[WAL_IOV_MAX + 1];
+    wal_seg_t *seg;
+    size_t size = 0;
+    uint32_t crc;
+    ssize_t n;
+
+    if (cnt > WAL_IOV_MAX){
+        errno = EINVAL;
+        return -1;
+    }
+    for (int i = 0; i < cnt; i++)
+        size += data[i].iov_len;
+    if (size > UINT32_MAX - sizeof(hdr)){
+        errno = EFBIG;
+        return -1;
+    }
+
+    if (wal->nsegs == 0 || (wal->segs[wal->nsegs - 1].size &&
+            (wal->segs[wal->nsegs - 1].size + sizeof(hdr) + size > wal->opts.seg_max ||
+             (wal->opts.seg_age_s && wal_now_s() - wal->segs[wal->nsegs - 1].created >= wal->opts.seg_age_s)))){
+        // closed segment must be durable before records go to the next one
+        if (wal->nsegs && wal->opts.sync_mode != WAL_SYNC_NONE){
+            if (wal_fdatasync(wal->segs[wal->nsegs - 1].fd))
+                return -1;
+            wal_idx_seal(&wal->segs[wal->nsegs - 1]);
+        }
+        if (wal_seg_create(wal, wal->next_seq))
+            return -1;
+    }
+    seg = &wal->segs[wal->nsegs - 1];
+
+    hdr.size = htole32(size);
+    hdr.seq = htole64(wal->next_seq);
+    crc = crc32c(0, (const char *)&hdr + WAL_HDR_CRC_OFFS, sizeof(hdr) - WAL_HDR_CRC_OFFS);
+    for (int i = 0; i < cnt; i++)
+        crc = crc32c(crc, data[i].iov_base, data[i].iov_len);
+    hdr.crc = htole32(crc);
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    memcpy(iov + 1, data, cnt * sizeof(struct iovec));
+    if ((n = writev(seg->fd, iov, cnt + 1)) != (ssize_t)(sizeof(hdr) + size)){
+        syslog(LOG_ERR, "%s: %m", "Error write record");
+        // don't leave partial record behind
+        if (n > 0 && ftruncate(seg->fd, seg->size) == -1)
+            syslog(LOG_ERR, "%s: %m", "Error truncate segment");
+        return -1;
+    }
+
+    if (wal_idx_add(wal, seg->size + sizeof(hdr), size)){
+        if (ftruncate(seg->fd, seg->size) == -1)
+            syslog(LOG_ERR, "%s: %m", "Error truncate segment");
+        return -1;
+    }
+    seg->size += sizeof(hdr) + size;
+    wal->next_seq++;
+
+    switch (wal->opts.sync_mode){
+    case WAL_SYNC_PACKET:
+        wal->dirty = 1;
+        break;
+    case WAL_SYNC_GROUP:
+        pthread_mutex_lock(&wal->bg_lock);
+        wal->sync_fd = seg->fd;
+        wal->unsynced += sizeof(hdr) + size;
+        if (wal->unsynced >= wal->opts.sync_bytes)
+            pthread_cond_signal(&wal->bg_cond);
+        pthread_mutex_unlock(&wal->bg_lock);
+        break;
+    case WAL_SYNC_NONE:
+        break;
+    }
+
+    wal_retain(wal);
+    return 0;
+}
+
+int wal_truncate(wal_t *wal, uint64_t next_seq){
+    size_t k = wal->nsegs, keep;
+    wal_seg_t *seg;
+    off_t size;
+
+    if (next_seq >= wal->next_seq)
+        return 0;
+    if (next_seq < wal->first_seq){
+        errno = EINVAL;
+        return -1;
+    }
+
+    // segments created after next_seq are deleted, segment of next_seq is current again
+    while (k > 1 && wal->segs[k - 1].first_seq > next_seq)
+        k--;
+    if (k < wal->nsegs){
+        if (wal->bg_running){
+            pthread_mutex_lock(&wal->bg_lock);
+            wal->sync_fd = wal->segs[k - 1].fd;
+            pthread_mutex_unlock(&wal->bg_lock);
+        }
+        wal_gc_run(wal, wal->segs + k, wal->nsegs - k);
+        wal->nsegs = k;
+    }
+    seg = &wal->segs[wal->nsegs - 1];
+    // sealed index was truncated to its records, it grows again
+    if (le32toh(seg->idx->flags) & WAL_IDX_SEALED){
+        if (wal_idx_map(seg, seg->idx_cap))
+            return -1;
+        seg->idx->flags = 0;
+    }
+
+    keep = next_seq - seg->first_seq;
+    size = keep ? (off_t)le32toh(seg->ents[keep - 1].off) + le32toh(seg->ents[keep - 1].size) : 0;
+    if (ftruncate(seg->fd, size) == -1){
+        syslog(LOG_ERR, "%s: %m", "Error truncate segment");
+        return -1;
+    }
+    seg->size = size;
+    seg->nrecs = keep;
+    seg->idx->nrecs = htole64(keep);
+    wal->next_seq = next_seq;
+    if (wal->start_seq > next_seq)
+        wal->start_seq = next_seq;
+    return 0;
+}
+
+static int wal_pending_add(wal_t *wal, const char *data, size_t size){
+    if (wal_grow((void **)&wal->pending, &wal->pending_cap, wal->pending_size + size, 1))
+        return -1;
+    memcpy(wal->pending + wal->pending_size, data, size);
+    wal->pending_size += size;
+    return 0;
+}
+
+ssize_t wal_write(wal_t *wal, const char *data, size_t count){
+    const char *pos = data, *end = data + count, *nl;
+    int err;
+
+    while ((nl = memchr(pos, '\n', end - pos)) != NULL){
+        if (wal->pending_size){
+            if (wal_pending_add(wal, pos, nl - pos + 1))
+                return -1;
+            err = wal_append(wal, wal->pending, wal->pending_size);
+            wal->pending_size = 0;
+        }
+        else
+            err = wal_append(wal, pos, nl - pos + 1);
+        if (err)
+            return pos == data ? -1 : pos - data;
+        pos = nl + 1;
+    }
+    if (pos < end && wal_pending_add(wal, pos, end - pos))
+        return pos == data ? -1 : pos - data;
+    return count;
+}
+
+uint64_t wal_start(wal_t *wal){
+    return wal->start_seq < wal->next_seq ? le64toh(wal_ent(wal, wal->start_seq)->pos) : wal_size(wal);
+}
+
+uint64_t wal_size(wal_t *wal){
+    wal_seg_t *seg;
+    struct wal_idx_ent *last;
+
+    if (wal->nsegs == 0)
+        return 0;
+    seg = &wal->segs[wal->nsegs - 1];
+    if (seg->nrecs == 0)
+        return seg->base;
+    last = &seg->ents[seg->nrecs - 1];
+    return le64toh(last->pos) + le32toh(last->size);
+}
+
+ssize_t wal_pread(wal_t *wal, char *buf, size_t count, uint64_t pos){
+    size_t done = 0, n, rec, seg_num;
+    struct wal_idx_ent *ent;
+    wal_seg_t *seg;
+    uint64_t ent_pos;
+    ssize_t rd;
+
+    if (pos >= wal_size(wal))
+        return 0;
+
+    rec = wal_rec_of_pos(wal, pos, &seg_num);
+    while (done < count && seg_num < wal->nsegs){
+        seg = &wal->segs[seg_num];
+        if (rec >= seg->nrecs){
+            seg_num++;
+            rec = 0;
+            continue;
+        }
+        ent = &seg->ents[rec++];
+        ent_pos = le64toh(ent->pos);
+        n = le32toh(ent->size) - (pos - ent_pos);
+        if (n > count - done)
+            n = count - done;
+        if ((rd = pread(seg->fd, buf + done, n, le32toh(ent->off) + (pos - ent_pos))) < 0)
+            return done ? (ssize_t)done : -1;
+        done += rd;
+        pos += rd;
+        if ((size_t)rd < n)
+            break;
+    }
+    return done;
+}
+
+int wal_record(wal_t *wal, uint64_t rec, uint64_t *pos, uint32_t *size){
+    struct wal_idx_ent *ent;
+
+    if (rec >= wal->next_seq - wal->start_seq){
+        errno = EINVAL;
+        return -1;
+    }
+    ent = wal_ent(wal, wal->start_seq + rec);
+    *pos = le64toh(ent->pos);
+    *size = le32toh(ent->size);
+    return 0;
+}
+
+uint64_t wal_records(wal_t *wal){
+    return wal->next_seq - wal->start_seq;
+}
+
+int wal_find(wal_t *wal, uint64_t rec, uint32_t offset, uint64_t *pos){
+    struct wal_idx_ent *ent;
+
+    if (rec >= wal->next_seq - wal->start_seq){
+        errno = EINVAL;
+        return -1;
+    }
+    ent = wal_ent(wal, wal->start_seq + rec);
+    if (offset >= le32toh(ent->size)){
+        errno = EINVAL;
+        return -1;
+    }
+    *pos = le64toh(ent->pos) + offset;
+    return 0;
+}
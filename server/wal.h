@@ -0,0 +1,245 @@
+/*
+ * wal.h
+ *
+ * Segmented write-ahead log used as storage of file backend.
+ *
+ * Log is a directory of segment files <first seq>.log. Segment is closed
+ * when it reaches segment size, the next record goes to new segment.
+ * Every newline terminated command is one record:
+ *     {crc32c, size, seq} + data
+ * crc covers size, seq and data.
+ *
+ * Every segment has index file <first seq>.idx mapped to memory: header and
+ * {stream position, offset, size} entry of every record, added on append.
+ * Record number or stream position is resolved by index without reading
+ * data, read of record is one pread. When segment is closed it is synced
+ * and its index is sealed. On open sealed indexes are trusted, the other
+ * segments (normally only the last one) are scanned, the scan stops at
+ * first torn or corrupted record and the log is truncated there.
+ *
+ * Data of all records read as one stream. Position in this stream is
+ * used as response cursor of channel.
+ *
+ * Rotation and retention (-S, -K options). Segment is also closed when it
+ * is older than max age. Like the driver keeps last N commands, log keeps
+ * visible only last N records and/or last B bytes of records; older records
+ * are trimmed from the stream at once. Segment whose records are all
+ * trimmed is removed from log and deleted by background thread, so disk
+ * use is bounded by retention plus one segment.
+ *
+ * Durability (-s option), guarantee at the moment client gets response:
+ *   sync       packet is on stable storage (fdatasync on every packet commit)
+ *   group:T:B  packet is written to page cache; background thread calls
+ *              fdatasync every T ms or when B bytes are not synced, so at most
+ *              T ms / B bytes of answered packets can be lost on power failure
+ *   none       packet is written to page cache, kernel writes it back
+ */
+
+#ifndef AESDSOCKET_WAL_H
+#define AESDSOCKET_WAL_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define WAL_SEGMENT_SIZE (16 * 1024 * 1024)
+#define WAL_SCAN_BUF (1024 * 1024)
+#define WAL_SEGMENT_FMT "%020llu.log"
+#define WAL_INDEX_FMT "%020llu.idx"
+#define WAL_IDX_MAGIC 0x58444957    /* "WIDX" */
+#define WAL_IDX_SEALED 1
+#define WAL_IDX_GROW 4096
+#define WAL_GROUP_SYNC_MS 10
+#define WAL_GROUP_SYNC_BYTES (1024 * 1024)
+#define WAL_SEGMENT_MIN 4096
+#define WAL_IOV_MAX 4
+
+enum wal_sync_mode{
+    WAL_SYNC_PACKET = 0,
+    WAL_SYNC_GROUP,
+    WAL_SYNC_NONE,
+};
+
+typedef struct wal_opts_s wal_opts_t;
+struct wal_opts_s{
+    size_t seg_max;
+    enum wal_sync_mode sync_mode;
+    unsigned sync_ms;       /* group: max time between syncs */
+    size_t sync_bytes;      /* group: max not synced bytes */
+    unsigned seg_age_s;     /* max age of segment, 0 - no limit */
+    uint64_t retain_records;    /* records kept, 0 - no limit */
+    uint64_t retain_bytes;      /* bytes of records kept, 0 - no limit */
+    unsigned shards;            /* shards of sharded log (shard.h), 0 - one log */
+};
+
+#define WAL_OPTS_DEFAULT {WAL_SEGMENT_SIZE, WAL_SYNC_PACKET, WAL_GROUP_SYNC_MS, WAL_GROUP_SYNC_BYTES, 0, 0, 0, 0}
+
+struct wal_rec_hdr{
+    uint32_t crc;
+    uint32_t size;
+    uint64_t seq;
+} __attribute__((packed));
+
+/* Index file header, little endian */
+struct wal_idx_hdr{
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t nrecs;
+    uint64_t base;      /* stream position of first record */
+    uint64_t reserved;
+} __attribute__((packed));
+
+/* Location of record, little endian. Entry i of segment has seq first_seq + i */
+struct wal_idx_ent{
+    uint64_t pos;       /* position of data in stream of all records */
+    uint32_t off;       /* offset of data in segment file */
+    uint32_t size;
+} __attribute__((packed));
+
+typedef struct wal_seg_s wal_seg_t;
+struct wal_seg_s{
+    uint64_t first_seq;
+    int fd;
+    off_t size;
+    time_t created;     /* monotonic seconds */
+
+    /* index file */
+    int idx_fd;
+    struct wal_idx_hdr *idx;    /* mapping: header and entries */
+    struct wal_idx_ent *ents;
+    size_t idx_cap;             /* entries in mapping */
+    size_t nrecs;
+    uint64_t base;
+};
+
+typedef struct wal_s wal_t;
+struct wal_s{
+    char dir[PATH_MAX];
+    wal_opts_t opts;
+
+    wal_seg_t *segs;
+    size_t nsegs, segs_cap;
+
+    uint64_t first_seq;
+    uint64_t next_seq;
+    uint64_t start_seq;     /* first visible record, older are trimmed */
+
+    /* unterminated command */
+    char *pending;
+    size_t pending_size, pending_cap;
+
+    int dirty;                  /* sync: data written after last sync */
+
+    /* background thread: group sync and removal of old segments */
+    pthread_t bg_thread;
+    int bg_running, bg_stop;
+    pthread_mutex_t bg_lock;
+    pthread_cond_t bg_cond;
+    int sync_fd;
+    size_t unsynced;
+    wal_seg_t *gc;              /* removed segments to delete */
+    size_t ngc, gc_cap;
+};
+
+/*!
+ * Open log in directory (created if necessary) and recover it
+ * @param opts options, NULL for defaults
+ * @return log or NULL on error
+ */
+wal_t *wal_open(const char *dir, const wal_opts_t *opts);
+
+void wal_close(wal_t *wal);
+
+/*!
+ * Write data. Every newline terminated command becomes a record,
+ * the rest is kept until new line is received.
+ * @return count or -1 on error
+ */
+ssize_t wal_write(wal_t *wal, const char *data, size_t count);
+
+/*!
+ * Append one record
+ * @return 0 on success
+ */
+int wal_append(wal_t *wal, const char *data, size_t size);
+
+/*!
+ * Append one record gathered from up to WAL_IOV_MAX buffers
+ * @return 0 on success
+ */
+int wal_appendv(wal_t *wal, const struct iovec *data, int cnt);
+
+/*!
+ * Remove records from next_seq to the end, rollback of records of failed packet.
+ * Segments created after next_seq are deleted. Trimmed records are not restored,
+ * start of log is moved back not before next_seq.
+ * @param next_seq not less than first_seq of log
+ * @return 0 on success
+ */
+int wal_truncate(wal_t *wal, uint64_t next_seq);
+
+/*!
+ * Read from stream of records starting from pos
+ * @param pos position not less than wal_start()
+ * @return number of bytes read, 0 at the end of log, -1 on error
+ */
+ssize_t wal_pread(wal_t *wal, char *buf, size_t count, uint64_t pos);
+
+/*!
+ * @param rec zero referenced record number counted from first visible record
+ * @param offset offset inside record
+ * @param pos position in stream
+ * @return 0 on success, -1 if record or offset doesn't exist
+ */
+int wal_find(wal_t *wal, uint64_t rec, uint32_t offset, uint64_t *pos);
+
+/*!
+ * Location of record in stream
+ * @param rec zero referenced record number counted from first visible record
+ * @return 0 on success, -1 if record doesn't exist
+ */
+int wal_record(wal_t *wal, uint64_t rec, uint64_t *pos, uint32_t *size);
+
+/*!
+ * @return number of visible records
+ */
+uint64_t wal_records(wal_t *wal);
+
+/*!
+ * @return position of first visible record in stream
+ */
+uint64_t wal_start(wal_t *wal);
+
+/*!
+ * @return end of stream of all records
+ */
+uint64_t wal_size(wal_t *wal);
+
+/*!
+ * Packet is committed. Makes written records durable according to sync mode.
+ * @return 0 on success
+ */
+int wal_commit(wal_t *wal);
+
+/*!
+ * Parse durability mode "sync", "group[:ms[:bytes]]" or "none"
+ * @return 0 on success
+ */
+int wal_parse_sync(const char *arg, wal_opts_t *opts);
+
+/*!
+ * Parse segment limits "bytes[:max_age_s]"
+ * @return 0 on success
+ */
+int wal_parse_segment(const char *arg, wal_opts_t *opts);
+
+/*!
+ * Parse retention "records[:bytes]", 0 is no limit
+ * @return 0 on success
+ */
+int wal_parse_retain(const char *arg, wal_opts_t *opts);
+
+#endif /* AESDSOCKET_WAL_H */
@@ -0,0 +1,100 @@
+/*
+ * Commit latency and throughput of log durability modes.
+ * Every packet is one record followed by commit, as in aesdsocket.
+ * Usage: ./wal_bench [dir [packets [packet size]]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "./wal.h"
+#include "./metrics.h"
+
+static double now_s(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void remove_log(const char *dir){
+    char path[PATH_MAX + 256];
+    struct dirent *de;
+    DIR *d = opendir(dir);
+
+    if (d == NULL)
+        return;
+    while ((de = readdir(d)) != NULL){
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+static int bench(const char *dir, const char *mode, size_t packets, size_t size){
+    wal_opts_t opts = WAL_OPTS_DEFAULT;
+    double *lat, start, total;
+    long fsyncs;
+    char *data;
+    wal_t *wal;
+
+    if (wal_parse_sync(mode, &opts) ||
+        (lat = malloc(packets * sizeof(double))) == NULL ||
+        (data = malloc(size)) == NULL)
+        return -1;
+    memset(data, 'x', size);
+    data[size - 1] = '\n';
+
+    remove_log(dir);
+    if ((wal = wal_open(dir, &opts)) == NULL){
+        printf("Error open log %s\n", dir);
+        return -1;
+    }
+    fsyncs = metric_value(metric_get("wal_fsyncs"));
+    total = now_s();
+    for (size_t i = 0; i < packets; i++){
+        start = now_s();
+        if (wal_write(wal, data, size) != size || wal_commit(wal)){
+            printf("Error write log\n");
+            return -1;
+        }
+        lat[i] = now_s() - start;
+    }
+    total = now_s() - total;
+    wal_close(wal);
+    fsyncs = metric_value(metric_get("wal_fsyncs")) - fsyncs;
+
+    qsort(lat, packets, sizeof(double), cmp_double);
+    printf("%-16s %10.1f %10.1f %12.0f %10ld\n", mode,
+           lat[packets / 2] * 1e6, lat[packets * 99 / 100] * 1e6,
+           packets / total, fsyncs);
+    remove_log(dir);
+    free(data);
+    free(lat);
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    const char *modes[] = {"sync", "group", "group:2", "group:50", "none"};
+    const char *dir = argc > 1 ? argv[1] : "wal_bench.d";
+    size_t packets = argc > 2 ? atoi(argv[2]) : 2000;
+    size_t size = argc > 3 ? atoi(argv[3]) : 128;
+
+    if (packets == 0 || size == 0)
+        return 1;
+    printf("%zu packets of %zu bytes in %s\n", packets, size, dir);
+    printf("%-16s %10s %10s %12s %10s\n", "mode", "p50 us", "p99 us", "packets/s", "fsyncs");
+    for (size_t i = 0; i < sizeof(modes)/sizeof(modes[0]); i++)
+        if (bench(dir, modes[i], packets, size))
+            return 1;
+    return 0;
+}